@@ -0,0 +1,42 @@
+#include "admission.h"
+
+bool Admission::waitForRoom() {
+	std::unique_lock<std::mutex> lock(mx);
+	cv.wait(lock, [&] { return stopped || total < maxConnections; });
+	return !stopped;
+}
+
+void Admission::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		stopped = true;
+	}
+	cv.notify_all();
+}
+
+std::unique_ptr<Admission::Slot> Admission::admit(const std::string& address) {
+	std::lock_guard<std::mutex> lock(mx);
+	if (total >= maxConnections) return nullptr;
+	if (!address.empty()) {
+		size_t& count = perAddress[address];
+		if (count >= maxPerAddress) {
+			if (count == 0) perAddress.erase(address);
+			return nullptr;
+		}
+		count++;
+	}
+	total++;
+	return std::make_unique<Slot>(*this, address);
+}
+
+void Admission::release(const std::string& address) {
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		total--;
+		if (!address.empty()) {
+			auto it = perAddress.find(address);
+			if (it != perAddress.end() && --it->second == 0) perAddress.erase(it);
+		}
+	}
+	cv.notify_one();
+}
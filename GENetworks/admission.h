@@ -0,0 +1,49 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Admission control for new connections. Caps the number of connections on the server and the number
+// from a single address, so an accept storm can't run the server out of sockets, threads or memory.
+class Admission {
+public:
+	// Holds a connection's place until it's destroyed. The session owns it for as long as it runs.
+	class Slot {
+	public:
+		Slot(Admission& owner, std::string address) : owner(owner), address(std::move(address)) {}
+		~Slot() { owner.release(address); }
+		Slot(const Slot&) = delete;
+		Slot& operator=(const Slot&) = delete;
+
+	private:
+		Admission& owner;
+		std::string address;
+	};
+
+	size_t maxConnections = 4096;
+	size_t maxPerAddress = 64;
+	int handshakeTimeoutMs = 10000; // Time a new connection gets to send its username
+
+	// Blocks while the server is full. The accept loops call this first, so further connections wait in the
+	// listen backlog instead of being accepted and turned away. Returns false once stop() has been called.
+	bool waitForRoom();
+
+	// Wakes every waitForRoom for good, the server is stopping and won't accept anything more.
+	void stop();
+
+	// Takes a place for a connection from address, or returns null if the server or the address is at its limit.
+	// An empty address (Unix socket clients) only counts towards the total.
+	std::unique_ptr<Slot> admit(const std::string& address);
+
+private:
+	void release(const std::string& address);
+
+	std::mutex mx;
+	std::condition_variable cv;
+	size_t total = 0;
+	bool stopped = false;
+	std::unordered_map<std::string, size_t> perAddress;
+};
@@ -0,0 +1,136 @@
+// Runs the server in this process, has two clients trade room messages and DMs through it and counts every
+// operator new while they do. Once the sessions are warmed up the message path (receive buffer, parsing,
+// replies, fan-out, outboxes) must not allocate at all, so any allocation fails the test.
+// Usage: alloc_test [port]
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+
+namespace {
+std::atomic<bool> counting{ false };
+std::atomic<uint64_t> allocations{ 0 };
+}
+
+void* operator new(size_t size) {
+	if (counting.load(std::memory_order_relaxed)) allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = std::malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// The server is a single translation unit (server.h defines its globals), so it's pulled in whole with its
+// main renamed, and started on a thread of its own.
+#define main runServer
+#include "server.cpp"
+#undef main
+
+namespace {
+
+const int warmupRounds = 500;
+const int countedRounds = 5000;
+
+SOCKET connectTo(unsigned short port) {
+	for (int attempt = 0; attempt < 100; attempt++) { // The server may still be starting
+		SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+		if (connect(s, (sockaddr*)&address, sizeof(address)) == 0) return s;
+		closesocket(s);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	return INVALID_SOCKET;
+}
+
+bool sendText(SOCKET s, const char* text, int length) {
+	while (length > 0) {
+		int sent = send(s, text, length, 0);
+		if (sent <= 0) return false;
+		text += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+// Reads until count more lines have come. Only counts them, into a fixed buffer, so the client side doesn't allocate either.
+bool readLines(SOCKET s, int count) {
+	char buf[4096];
+	while (count > 0) {
+		int received = recv(s, buf, sizeof(buf), 0);
+		if (received <= 0) return false;
+		for (int i = 0; i < received; i++)
+			if (buf[i] == '\n') count--;
+	}
+	return true;
+}
+
+// Skips whatever the server sent so far, like the welcome and the user lists.
+void drain(SOCKET s) {
+	char buf[4096];
+	u_long nonBlocking = 1;
+	ioctlsocket(s, FIONBIO, &nonBlocking);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	while (recv(s, buf, sizeof(buf), 0) > 0) {}
+	nonBlocking = 0;
+	ioctlsocket(s, FIONBIO, &nonBlocking);
+}
+
+// One round: alice says something in the room and DMs bob, bob DMs back. Each of them gets three lines.
+bool exchange(SOCKET alice, SOCKET bob, int rounds) {
+	static const char fromAlice[] = "/room r hello everyone\n/msg bob hi bob\n";
+	static const char fromBob[] = "/msg alice hi alice\n";
+	for (int i = 0; i < rounds; i++) {
+		if (!sendText(alice, fromAlice, sizeof(fromAlice) - 1) || !sendText(bob, fromBob, sizeof(fromBob) - 1)) return false;
+		if (!readLines(alice, 3) || !readLines(bob, 3)) return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	std::string port = argc > 1 ? argv[1] : "65400";
+	std::thread([port] {
+		std::string args[] = { "alloc_test", "--port", port, "--io-threads", "1",
+			"--rate-broadcast", "0", "--rate-dm", "0", "--rate-command", "0" };
+		char* argv[std::size(args)];
+		for (size_t i = 0; i < std::size(args); i++) argv[i] = &args[i][0];
+		std::exit(runServer((int)std::size(args), argv)); // Only returns if it couldn't start
+	}).detach();
+
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+	SOCKET alice = connectTo((unsigned short)std::stoi(port));
+	SOCKET bob = connectTo((unsigned short)std::stoi(port));
+	if (alice == INVALID_SOCKET || bob == INVALID_SOCKET) {
+		std::cerr << "Could not connect to the server" << std::endl;
+		return 1;
+	}
+	sendText(alice, "alice\n/join r\n", 14);
+	sendText(bob, "bob\n/join r\n", 12);
+	drain(alice);
+	drain(bob);
+
+	if (!exchange(alice, bob, warmupRounds)) {
+		std::cerr << "Lost the connection while warming up" << std::endl;
+		return 1;
+	}
+	counting.store(true);
+	bool ok = exchange(alice, bob, countedRounds);
+	counting.store(false);
+	if (!ok) {
+		std::cerr << "Lost the connection" << std::endl;
+		return 1;
+	}
+
+	uint64_t counted = allocations.load();
+	std::cout << counted << " allocations over " << countedRounds * 3 << " lines sent and " << countedRounds * 6 << " received" << std::endl;
+	std::cout.flush();
+	std::_Exit(counted == 0 ? 0 : 1); // The server's threads are still running, skip the static destructors
+}
@@ -0,0 +1,532 @@
+// Benchmarks for the server. Each one is a mode of this program:
+//   bench rooms [users]     cost of a room message against a server-wide broadcast, over a range of room sizes
+//   bench fanout [threads]  time to fan one message out to a room, by room size and fan-out pool size
+//   bench unix [messages]   DM latency between two clients over TCP loopback and over the Unix socket
+//   bench udp [loss%] [messages]   delivery latency over lossy reliable UDP, one conversation against sixteen
+//   bench coalesce [messages]   sends per message and latency for single DMs and for bursts of them
+//   bench load [messages] [server flags]   DM latency while other clients keep a room busy, run it once with
+//                                          and once without the low latency flags (--busy-poll, --pin-cores)
+// The modes that need a running server start one in this process on port 65401 (or BENCH_PORT).
+// Numbers go to stdout as a table.
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iterator>
+
+// The server is a single translation unit (server.h defines its globals), so it's pulled in whole with its
+// main renamed. Benchmarks that need a running server start it on a thread of their own.
+#define main runServer
+#include "server.cpp"
+#undef main
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+double elapsedUs(BenchClock::time_point start) {
+	return std::chrono::duration<double, std::micro>(BenchClock::now() - start).count();
+}
+
+// A user with an outbox but no connection: what they're sent piles up until discard() throws it away.
+// Enough to time the fan-out itself without sockets or writer threads in the way.
+std::shared_ptr<Outbox> addOfflineUser(int i) {
+	auto box = std::make_shared<Outbox>();
+	box->socket = (SOCKET)(100000 + i);
+	std::string name = "user" + std::to_string(i);
+	std::lock_guard<std::mutex> lock(mx);
+	outboxes[box->socket] = box;
+	clients[name] = box->socket;
+	clientSockets[box->socket] = name;
+	return box;
+}
+
+void discard(const OutboxList& boxes) {
+	for (const auto& box : boxes) {
+		std::lock_guard<std::mutex> lock(box->mx);
+		for (auto& piece : box->pending) {
+			if (!piece.shared) bufferPool.give(std::move(piece.bytes), box->node);
+		}
+		box->pending.clear();
+	}
+}
+
+void removeOfflineUsers(const OutboxList& boxes) {
+	std::lock_guard<std::mutex> lock(mx);
+	for (const auto& box : boxes) {
+		outboxes.erase(box->socket);
+		clients.erase(clientSockets[box->socket]);
+		clientSockets.erase(box->socket);
+		clientRooms.erase(box->socket);
+	}
+	rooms.clear();
+}
+
+// Users spread evenly over a number of rooms. A room message should cost in proportion to the room's size,
+// whatever the number of users on the server; a broadcast walks all of them.
+int benchRooms(int argc, char* argv[]) {
+	int users = argc > 0 ? std::atoi(argv[0]) : 10000;
+	const std::string line = "[room] someone: a message of an ordinary length for a chat room";
+
+	std::cout << users << " users, " << line.size() + 1 << " byte lines, fan-out on one thread" << std::endl;
+	std::cout << std::setw(8) << "rooms" << std::setw(12) << "per room" << std::setw(16) << "us/message" << std::setw(18) << "ns/recipient" << std::endl;
+	fanoutPool.start(0);
+	for (int roomCount : { 5000, 500, 50, 5 }) {
+		if (roomCount > users) continue;
+		OutboxList boxes;
+		for (int i = 0; i < users; i++) {
+			boxes.push_back(addOfflineUser(i));
+			joinRoom(boxes.back()->socket, "room" + std::to_string(i % roomCount));
+		}
+		std::vector<std::string> names;
+		for (int r = 0; r < roomCount; r++) names.push_back("room" + std::to_string(r));
+
+		int messages = std::max(2000, 200000 * roomCount / users); // About the same number of deliveries at every size
+		for (int i = 0; i < roomCount; i++) roomcastLocal(names[i], line); // Warm the snapshots and buffers
+		discard(boxes);
+		double us = 0;
+		for (int done = 0; done < messages; done += 100) {
+			auto start = BenchClock::now();
+			for (int i = done; i < done + 100; i++) roomcastLocal(names[i % roomCount], line);
+			us += elapsedUs(start);
+			discard(boxes);
+		}
+		double perRoom = (double)users / roomCount;
+		std::cout << std::setw(8) << roomCount << std::setw(12) << users / roomCount << std::fixed << std::setprecision(2)
+			<< std::setw(16) << us / messages << std::setw(18) << us * 1000 / messages / perRoom << std::defaultfloat << std::endl;
+		removeOfflineUsers(boxes);
+	}
+
+	OutboxList boxes;
+	for (int i = 0; i < users; i++) boxes.push_back(addOfflineUser(i));
+	double us = 0;
+	const int broadcasts = 200;
+	for (int done = 0; done < broadcasts; done += 10) {
+		auto start = BenchClock::now();
+		for (int i = 0; i < 10; i++) broadcastLocal(line);
+		us += elapsedUs(start);
+		discard(boxes);
+	}
+	std::cout << std::setw(8) << "all" << std::setw(12) << users << std::fixed << std::setprecision(2)
+		<< std::setw(16) << us / broadcasts << std::setw(18) << us * 1000 / broadcasts / users << std::defaultfloat
+		<< "   (broadcast to the whole server)" << std::endl;
+	removeOfflineUsers(boxes);
+	return 0;
+}
+
+// One room, timed the way a session fans out to it: fanout() returns once every member has the line queued.
+// Rooms under parallelFanoutMin are always done on the calling thread.
+int benchFanout(int argc, char* argv[]) {
+	unsigned int maxThreads = argc > 0 ? (unsigned int)std::atoi(argv[0]) : std::max(std::thread::hardware_concurrency(), 1u);
+	const std::string line = "[room] someone: a message of an ordinary length for a chat room";
+	const int sizes[] = { 1000, 10000, 50000, 100000 };
+	std::vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t <= maxThreads; t *= 2) threadCounts.push_back(t);
+	if (threadCounts.back() != maxThreads) threadCounts.push_back(maxThreads);
+
+	std::cout << "us per message, by room size and threads (pool workers plus the caller), "
+		<< std::thread::hardware_concurrency() << " cores" << std::endl;
+	std::cout << std::setw(10) << "members";
+	for (unsigned int t : threadCounts) std::cout << std::setw(10) << t;
+	std::cout << std::endl;
+
+	OutboxList boxes;
+	for (int i = 0; i < sizes[std::size(sizes) - 1]; i++) boxes.push_back(addOfflineUser(i));
+	for (int size : sizes) {
+		OutboxList room(boxes.begin(), boxes.begin() + size);
+		std::cout << std::setw(10) << size << std::fixed << std::setprecision(1);
+		for (unsigned int t : threadCounts) {
+			fanoutPool.start(t - 1);
+			int messages = std::max(20, 2000000 / size);
+			fanout(room, line); // Warm up
+			discard(room);
+			double us = 0;
+			for (int done = 0; done < messages; done += 10) {
+				auto start = BenchClock::now();
+				for (int i = 0; i < 10; i++) fanout(room, line);
+				us += elapsedUs(start);
+				discard(room);
+			}
+			std::cout << std::setw(10) << us / messages;
+		}
+		std::cout << std::defaultfloat << std::endl;
+	}
+	removeOfflineUsers(boxes);
+	return 0;
+}
+
+unsigned short benchPort() {
+	const char* port = std::getenv("BENCH_PORT");
+	return port ? (unsigned short)std::atoi(port) : 65401;
+}
+
+// Starts the server on a thread of its own with the given flags on top of --port.
+void startServer(std::vector<std::string> flags) {
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData); // For the clients, the server makes its own call
+	flags.insert(flags.begin(), { "bench", "--port", std::to_string(benchPort()) });
+	std::thread([flags]() mutable {
+		std::vector<char*> argv;
+		for (auto& flag : flags) argv.push_back(&flag[0]);
+		std::exit(runServer((int)argv.size(), argv.data())); // Only returns if it couldn't start
+	}).detach();
+}
+
+// Connects to the server once it's up, over TCP loopback or, given a path, its Unix socket.
+SOCKET connectToServer(const std::string& unixPath = std::string()) {
+	for (int attempt = 0; attempt < 100; attempt++) {
+		SOCKET s;
+		int result;
+		if (unixPath.empty()) {
+			s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(benchPort());
+			inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+			result = connect(s, (sockaddr*)&address, sizeof(address));
+			BOOL noDelay = TRUE;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+		}
+		else {
+			s = socket(AF_UNIX, SOCK_STREAM, 0);
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			std::copy(unixPath.begin(), unixPath.end(), address.sun_path);
+			result = connect(s, (sockaddr*)&address, sizeof(address));
+		}
+		if (result == 0) return s;
+		closesocket(s);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	std::cerr << "Could not connect to the server" << std::endl;
+	std::_Exit(1);
+}
+
+void sendText(SOCKET s, const std::string& text) {
+	size_t done = 0;
+	while (done < text.size()) {
+		int sent = send(s, text.data() + done, (int)(text.size() - done), 0);
+		if (sent <= 0) {
+			std::cerr << "Lost the connection to the server" << std::endl;
+			std::_Exit(1);
+		}
+		done += sent;
+	}
+}
+
+// Reads until count more lines have come.
+void readLines(SOCKET s, int count) {
+	char buf[4096];
+	while (count > 0) {
+		int received = recv(s, buf, sizeof(buf), 0);
+		if (received <= 0) {
+			std::cerr << "Lost the connection to the server" << std::endl;
+			std::_Exit(1);
+		}
+		for (int i = 0; i < received; i++)
+			if (buf[i] == '\n') count--;
+	}
+}
+
+// Skips whatever the server sent so far, like the welcome and the user lists.
+void drain(SOCKET s) {
+	char buf[4096];
+	u_long nonBlocking = 1;
+	ioctlsocket(s, FIONBIO, &nonBlocking);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	while (recv(s, buf, sizeof(buf), 0) > 0) {}
+	nonBlocking = 0;
+	ioctlsocket(s, FIONBIO, &nonBlocking);
+}
+
+SOCKET logIn(const std::string& name, const std::string& unixPath = std::string()) {
+	SOCKET s = connectToServer(unixPath);
+	sendText(s, name + "\n");
+	return s;
+}
+
+// Sorted samples in microseconds, printed as the end of a row.
+void printPercentiles(std::vector<double>& us) {
+	std::sort(us.begin(), us.end());
+	double sum = 0;
+	for (double u : us) sum += u;
+	auto at = [&](double q) { return us[std::min(us.size() - 1, (size_t)(q * us.size()))]; };
+	std::cout << std::fixed << std::setprecision(1) << std::setw(10) << sum / us.size() << std::setw(10) << at(0.5)
+		<< std::setw(10) << at(0.99) << std::setw(10) << at(0.999) << std::defaultfloat << std::endl;
+}
+
+void printLatencies(const std::string& label, std::vector<double>& us) {
+	std::cout << std::setw(14) << label;
+	printPercentiles(us);
+}
+
+void printLatencyHeader() {
+	std::cout << std::setw(14) << "us" << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p99"
+		<< std::setw(10) << "p99.9" << std::endl;
+}
+
+// Time from one client sending a DM to the other having read it, one message in flight at a time.
+// The TCP and the Unix pair take turns so both see the same conditions.
+int benchUnix(int argc, char* argv[]) {
+	int messages = argc > 0 ? std::atoi(argv[0]) : 10000;
+	std::string path = (std::filesystem::temp_directory_path() / "genetworks-bench.sock").string();
+	startServer({ "--unix", path, "--rate-dm", "0" });
+
+	SOCKET tcpFrom = logIn("tcpfrom"), tcpTo = logIn("tcpto");
+	SOCKET unixFrom = logIn("unixfrom", path), unixTo = logIn("unixto", path);
+	for (SOCKET s : { tcpFrom, tcpTo, unixFrom, unixTo }) drain(s);
+
+	std::vector<double> tcp, local;
+	auto sample = [](SOCKET from, SOCKET to, const std::string& line) {
+		auto start = BenchClock::now();
+		sendText(from, line);
+		readLines(to, 1);
+		double us = elapsedUs(start);
+		readLines(from, 1); // The sender's copy
+		return us;
+	};
+	const std::string toTcp = "/msg tcpto a direct message of an ordinary length\n";
+	const std::string toUnix = "/msg unixto a direct message of an ordinary length\n";
+	for (int i = 0; i < messages / 10; i++) { // Warm up
+		sample(tcpFrom, tcpTo, toTcp);
+		sample(unixFrom, unixTo, toUnix);
+	}
+	for (int i = 0; i < messages; i++) {
+		tcp.push_back(sample(tcpFrom, tcpTo, toTcp));
+		local.push_back(sample(unixFrom, unixTo, toUnix));
+	}
+
+	std::cout << messages << " DMs each way, client to server to client" << std::endl;
+	printLatencyHeader();
+	printLatencies("TCP loopback", tcp);
+	printLatencies("Unix socket", local);
+	std::remove(path.c_str());
+	return 0;
+}
+
+// Room messages from a TCP client to a UDP client, with packets lost both ways and 10 ms of delay each way.
+// First every message goes to one room, so like TCP a lost packet holds up everything behind it. Then the
+// same messages are spread over sixteen rooms, each on its own lane, and a loss only holds up its own room.
+int benchUdp(int argc, char* argv[]) {
+	double loss = argc > 0 ? std::atof(argv[0]) : 2;
+	int messages = argc > 1 ? std::atoi(argv[1]) : 2000;
+	const int roomCount = 16;
+	const auto interval = std::chrono::milliseconds(2);
+	unsigned short udpPort = benchPort() + 1;
+	std::ostringstream lossFlag;
+	lossFlag << loss;
+	startServer({ "--udp", std::to_string(udpPort), "--udp-loss", lossFlag.str(), "--udp-delay", "10",
+		"--rate-broadcast", "0", "--rate-command", "0" });
+
+	std::string joins = "/join solo\n";
+	for (int r = 0; r < roomCount; r++) joins += "/join r" + std::to_string(r) + "\n";
+	SOCKET sender = logIn("sender");
+	sendText(sender, joins);
+	std::thread([sender] { // The sender gets its own messages back, nobody needs them
+		char buf[4096];
+		while (recv(sender, buf, sizeof(buf), 0) > 0) {}
+	}).detach();
+
+	UdpEndpoint endpoint;
+	UdpEndpoint::Impairment impairment;
+	impairment.loss = loss / 100;
+	impairment.delayMs = 10;
+	endpoint.setImpairment(impairment);
+	std::shared_ptr<UdpSession> receiver = endpoint.connect("127.0.0.1", udpPort);
+	if (!receiver) {
+		std::cerr << "Could not connect over UDP" << std::endl;
+		return 1;
+	}
+	std::string hello = "receiver\n" + joins;
+	receiver->sendAll(hello.data(), (int)hello.size());
+
+	// Arrival time of every message, by phase and number. The receive thread fills them in.
+	std::vector<BenchClock::time_point> sent[2], arrived[2];
+	for (int phase = 0; phase < 2; phase++) {
+		sent[phase].resize(messages);
+		arrived[phase].resize(messages);
+	}
+	std::atomic<int> arrivals{ 0 };
+	std::thread reader([&] {
+		char buf[4096];
+		std::string line;
+		while (true) {
+			int received = receiver->receive(buf, sizeof(buf));
+			if (received <= 0) return;
+			auto now = BenchClock::now();
+			for (int i = 0; i < received; i++) {
+				if (buf[i] != '\n') {
+					line.push_back(buf[i]);
+					continue;
+				}
+				// [solo] sender: 12 or [r3] sender: 12
+				size_t text = line.find("] sender: ");
+				if (line.size() > 1 && line[0] == '[' && text != std::string::npos) {
+					int phase = line.compare(1, 4, "solo") == 0 ? 0 : 1;
+					int n = std::atoi(line.c_str() + text + 10);
+					if (n >= 0 && n < messages) {
+						arrived[phase][n] = now;
+						arrivals.fetch_add(1);
+					}
+				}
+				line.clear();
+			}
+		}
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(500)); // Joins done
+
+	std::cout << messages << " messages a phase, one every " << interval.count() << " ms, " << loss
+		<< "% loss and 10 ms delay each way" << std::endl;
+	printLatencyHeader();
+	for (int phase = 0; phase < 2; phase++) {
+		int expected = arrivals.load() + messages;
+		auto next = BenchClock::now();
+		for (int i = 0; i < messages; i++) {
+			std::this_thread::sleep_until(next);
+			next += interval;
+			std::string room = phase == 0 ? "solo" : "r" + std::to_string(i % roomCount);
+			sent[phase][i] = BenchClock::now();
+			sendText(sender, "/room " + room + " " + std::to_string(i) + "\n");
+		}
+		auto deadline = BenchClock::now() + std::chrono::seconds(10);
+		while (arrivals.load() < expected && BenchClock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		std::vector<double> us;
+		for (int i = 0; i < messages; i++) {
+			if (arrived[phase][i] != BenchClock::time_point())
+				us.push_back(std::chrono::duration<double, std::micro>(arrived[phase][i] - sent[phase][i]).count());
+		}
+		if (us.size() < (size_t)messages) std::cout << messages - us.size() << " messages never arrived" << std::endl;
+		if (!us.empty()) printLatencies(phase == 0 ? "1 room" : std::to_string(roomCount) + " rooms", us);
+	}
+	receiver->close();
+	reader.join();
+	endpoint.stop();
+	return 0;
+}
+
+// DMs sent one at a time and in bursts that arrive in one read. The server's sends per message show how much
+// a burst gets coalesced (two recipients per DM: the other user and the sender's copy). Each send with
+// TCP_NODELAY goes out as at least one packet. Latency is from the client's send to the last line of the
+// burst arriving.
+int benchCoalesce(int argc, char* argv[]) {
+	int messages = argc > 0 ? std::atoi(argv[0]) : 20000;
+	startServer({ "--rate-dm", "0" });
+	SOCKET from = logIn("from"), to = logIn("to");
+	drain(from);
+	drain(to);
+
+	std::cout << messages << " DMs per row, client to server to client" << std::endl;
+	std::cout << std::setw(14) << "burst" << std::setw(16) << "sends/message" << std::setw(10) << "mean"
+		<< std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::endl;
+	for (int burst : { 1, 4, 16, 64, 256 }) {
+		std::string text;
+		for (int i = 0; i < burst; i++) text += "/msg to a direct message of an ordinary length\n";
+		auto sample = [&] {
+			auto start = BenchClock::now();
+			sendText(from, text);
+			readLines(to, burst);
+			double us = elapsedUs(start);
+			readLines(from, burst); // The sender's copies
+			return us;
+		};
+		int bursts = std::max(1, messages / burst);
+		for (int i = 0; i < bursts / 10; i++) sample(); // Warm up
+
+		std::vector<double> us;
+		uint64_t sendsBefore = outboxSends.load();
+		for (int i = 0; i < bursts; i++) us.push_back(sample());
+		double perMessage = (double)(outboxSends.load() - sendsBefore) / ((double)bursts * burst);
+		std::ostringstream label;
+		label << burst << (burst == 1 ? " line" : " lines");
+		std::cout << std::setw(14) << label.str() << std::fixed << std::setprecision(2) << std::setw(16) << perMessage
+			<< std::defaultfloat;
+		printPercentiles(us);
+	}
+	return 0;
+}
+
+// Round trip of a DM, one at a time, while eight clients keep a room of their own busy with a message
+// every 500 us each (16000 deliveries a second). The server is started with whatever flags follow the message
+// count, so runs with and without the low latency mode can be compared.
+int benchLoad(int argc, char* argv[]) {
+	int messages = argc > 0 ? std::atoi(argv[0]) : 20000;
+	std::vector<std::string> flags = { "--rate-broadcast", "0", "--rate-dm", "0", "--rate-command", "0" };
+	for (int i = 1; i < argc; i++) flags.push_back(argv[i]);
+	startServer(flags);
+
+	const int loaders = 8;
+	std::atomic<bool> loading{ true };
+	std::vector<std::thread> threads;
+	for (int i = 0; i < loaders; i++) {
+		SOCKET s = logIn("load" + std::to_string(i));
+		sendText(s, "/join busy\n");
+		threads.emplace_back([s, &loading] {
+			u_long nonBlocking = 1;
+			ioctlsocket(s, FIONBIO, &nonBlocking); // Takes whatever the room sent it between its own messages
+			const std::string line = "/room busy a room message of an ordinary length\n";
+			char buf[16384];
+			auto next = BenchClock::now();
+			while (loading.load(std::memory_order_relaxed)) {
+				send(s, line.data(), (int)line.size(), 0);
+				while (recv(s, buf, sizeof(buf), 0) > 0) {}
+				next += std::chrono::microseconds(500);
+				std::this_thread::sleep_until(next);
+			}
+		});
+	}
+	SOCKET from = logIn("probefrom"), to = logIn("probeto");
+	drain(from);
+	drain(to);
+
+	std::vector<double> us;
+	const std::string dm = "/msg probeto a direct message of an ordinary length\n";
+	for (int i = 0; i < messages / 10 + messages; i++) {
+		auto start = BenchClock::now();
+		sendText(from, dm);
+		readLines(to, 1);
+		if (i >= messages / 10) us.push_back(elapsedUs(start)); // After the warm up
+		readLines(from, 1); // The sender's copy
+	}
+	loading = false;
+	for (auto& thread : threads) thread.join();
+
+	std::cout << messages << " DMs under load, server flags:";
+	for (int i = 1; i < argc; i++) std::cout << " " << argv[i];
+	std::cout << std::endl;
+	printLatencyHeader();
+	printLatencies("DM", us);
+	return 0;
+}
+
+struct Mode {
+	const char* name;
+	int (*run)(int argc, char* argv[]);
+};
+
+const Mode modes[] = {
+	{ "rooms", benchRooms },
+	{ "fanout", benchFanout },
+	{ "unix", benchUnix },
+	{ "udp", benchUdp },
+	{ "coalesce", benchCoalesce },
+	{ "load", benchLoad },
+};
+
+}
+
+int main(int argc, char* argv[]) {
+	std::string mode = argc > 1 ? argv[1] : "";
+	for (const Mode& m : modes) {
+		if (mode != m.name) continue;
+		int result = m.run(argc - 2, argv + 2);
+		std::cout.flush();
+		std::_Exit(result); // Server threads may still be running, skip the static destructors
+	}
+	std::cerr << "Usage: " << argv[0] << " <mode> [args], modes:";
+	for (const Mode& m : modes) std::cerr << " " << m.name;
+	std::cerr << std::endl;
+	return 1;
+}
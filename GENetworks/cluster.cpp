@@ -0,0 +1,460 @@
+#include "cluster.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+bool busSend(SOCKET s, const std::string& data) {
+	int sentSum = 0;
+	int len = (int)data.size();
+	while (sentSum < len) {
+		int sent = send(s, data.c_str() + sentSum, len - sentSum, 0);
+		if (sent == SOCKET_ERROR) return false;
+		sentSum += sent;
+	}
+	return true;
+}
+
+// True once the other end has closed a connection it never sends on. Anything it did send is thrown away.
+bool hungUp(SOCKET s) {
+	WSAPOLLFD p = {};
+	p.fd = s;
+	p.events = POLLRDNORM;
+	int ready = WSAPoll(&p, 1, 0);
+	if (ready == 0) return false;
+	char chunk[256];
+	return ready < 0 || recv(s, chunk, sizeof(chunk), 0) <= 0;
+}
+
+// Reads the next \n terminated line from a bus socket, keeping leftovers in buf.
+bool busReadLine(SOCKET s, std::string& buf, std::string& line) {
+	while (true) {
+		size_t pos = buf.find('\n');
+		if (pos != std::string::npos) {
+			line.assign(buf, 0, pos);
+			buf.erase(0, pos + 1);
+			line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+			return true;
+		}
+		char chunk[4096];
+		int received = recv(s, chunk, sizeof(chunk), 0);
+		if (received <= 0) return false;
+		buf.append(chunk, chunk + received);
+	}
+}
+
+// Splits a bus line on tabs. The last field keeps the rest of the line so chat text can contain tabs.
+std::vector<std::string> splitFields(const std::string& line, size_t maxFields) {
+	std::vector<std::string> fields;
+	size_t start = 0;
+	while (fields.size() + 1 < maxFields) {
+		size_t tab = line.find('\t', start);
+		if (tab == std::string::npos) break;
+		fields.push_back(line.substr(start, tab - start));
+		start = tab + 1;
+	}
+	fields.push_back(line.substr(start));
+	return fields;
+}
+
+size_t fieldCount(const std::string& line) {
+	if (line.rfind("ROOM\t", 0) == 0 || line.rfind("SYS\t", 0) == 0) return 3;
+	if (line.rfind("DM\t", 0) == 0) return 4;
+	if (line.rfind("ROSTER", 0) == 0) return std::string::npos;
+	return 2;
+}
+
+}
+
+Cluster::~Cluster() {
+	stop();
+}
+
+bool Cluster::start(const std::string& name, unsigned short busPort, const std::vector<std::string>& peerAddresses, Handlers h) {
+	node = name;
+	handlers = std::move(h);
+
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET) {
+		std::cerr << "Bus socket failed: " << WSAGetLastError() << std::endl;
+		return false;
+	}
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(busPort);
+	address.sin_addr.s_addr = INADDR_ANY;
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+		std::cerr << "Bus listen on port " << busPort << " failed: " << WSAGetLastError() << std::endl;
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		return false;
+	}
+
+	running.store(true);
+	acceptor = std::thread(&Cluster::acceptLoop, this);
+
+	for (const auto& a : peerAddresses) {
+		size_t colon = a.rfind(':');
+		if (colon == std::string::npos) {
+			std::cerr << "Ignoring peer without a port: " << a << std::endl;
+			continue;
+		}
+		auto peer = std::make_unique<Peer>();
+		peer->address = a;
+		peer->host = a.substr(0, colon);
+		peer->port = (unsigned short)std::stoi(a.substr(colon + 1));
+		peers.push_back(std::move(peer));
+	}
+	for (auto& peer : peers)
+		peer->dialer = std::thread(&Cluster::dial, this, peer.get());
+	return true;
+}
+
+void Cluster::stop() {
+	if (!running.exchange(false)) return;
+	closesocket(listener);
+	listener = INVALID_SOCKET;
+	for (auto& peer : peers) {
+		std::lock_guard<std::mutex> lock(peer->mx);
+		if (peer->socket != INVALID_SOCKET) shutdown(peer->socket, SD_BOTH);
+		peer->wake.notify_all();
+	}
+	if (acceptor.joinable()) acceptor.join();
+	for (auto& peer : peers) {
+		if (peer->dialer.joinable()) peer->dialer.join();
+	}
+}
+
+// Queues a line for the peer's dialer to write. Returns false if the link is down, or if the peer has
+// stopped taking data and let peerQueueLimit bytes pile up, which cuts the link so the dialer starts over.
+bool Cluster::sendTo(Peer& peer, const std::string& line) {
+	std::lock_guard<std::mutex> lock(peer.mx);
+	if (!peer.connected) return false;
+	if (peer.outgoing.size() + line.size() >= peerQueueLimit) {
+		peer.connected = false;
+		peer.outgoing.clear();
+		shutdown(peer.socket, SD_BOTH); // The dialer notices and reconnects
+		peer.wake.notify_one();
+		return false;
+	}
+	if (peer.outgoing.empty()) peer.wake.notify_one();
+	peer.outgoing += line;
+	peer.outgoing += '\n';
+	return true;
+}
+
+void Cluster::sendToAll(const std::string& line) {
+	for (auto& peer : peers) sendTo(*peer, line);
+}
+
+bool Cluster::sendToNode(const std::string& nodeName, const std::string& line) {
+	Peer* peer = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = peerNodes.find(nodeName);
+		if (it != peerNodes.end()) peer = it->second;
+	}
+	return peer && sendTo(*peer, line);
+}
+
+void Cluster::publishJoin(const std::string& user) {
+	if (enabled()) sendToAll("JOIN\t" + user);
+}
+
+void Cluster::publishLeave(const std::string& user) {
+	if (enabled()) sendToAll("LEAVE\t" + user);
+}
+
+void Cluster::publishAll(const std::string& line) {
+	if (enabled()) sendToAll("ALL\t" + line);
+}
+
+void Cluster::publishRoom(const std::string& room, const std::string& line) {
+	if (enabled()) sendToAll("ROOM\t" + room + "\t" + line);
+}
+
+Cluster::DMResult Cluster::sendDM(const std::string& from, const std::string& to, const std::string& message) {
+	if (!enabled()) return DMResult::NoSuchUser;
+	std::string session;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = remoteUsers.find(to);
+		if (it == remoteUsers.end()) return DMResult::NoSuchUser;
+		session = it->second;
+	}
+	if (!sendToNode(session, "DM\t" + from + "\t" + to + "\t" + message))
+		park(from, to, message); // No link to the user's node right now
+	return DMResult::Sent;
+}
+
+// A DM arrived over the bus. The sender's node thought the user was here, if they've gone it gets told.
+void Cluster::receiveDM(const std::string& from, const std::string& to, const std::string& message) {
+	if (!handlers.deliverDM(from, to, message)) routeSystem(from, "User not found: " + to);
+}
+
+// Sends a line to a user on whichever node they're connected to.
+void Cluster::routeSystem(const std::string& to, const std::string& line) {
+	std::string session;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = remoteUsers.find(to);
+		if (it != remoteUsers.end()) session = it->second;
+	}
+	if (session.empty()) handlers.deliverSystem(to, line);
+	else sendToNode(session, "SYS\t" + to + "\t" + line);
+}
+
+void Cluster::park(const std::string& from, const std::string& to, const std::string& message) {
+	std::lock_guard<std::mutex> lock(mx);
+	std::deque<ParkedDM>& box = mailboxes[to];
+	if (box.size() >= mailboxLimit) box.pop_front();
+	box.push_back({ from, message, std::chrono::steady_clock::now() });
+}
+
+// Retries every parked DM, in order per user. Mailboxes of users that left, and DMs that waited too long, are dropped.
+void Cluster::flushMailboxes() {
+	std::unordered_map<std::string, std::deque<ParkedDM>> pending;
+	std::unordered_map<std::string, std::string> sessions;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		if (mailboxes.empty()) return;
+		std::swap(pending, mailboxes);
+		for (const auto& m : pending) {
+			auto it = remoteUsers.find(m.first);
+			if (it != remoteUsers.end()) sessions[m.first] = it->second;
+		}
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	for (auto& m : pending) {
+		auto session = sessions.find(m.first);
+		if (session == sessions.end()) continue;
+		std::deque<ParkedDM>& box = m.second;
+		while (!box.empty()) {
+			const ParkedDM& dm = box.front();
+			if (now - dm.at > mailboxTtl) {
+				box.pop_front();
+				continue;
+			}
+			if (!sendToNode(session->second, "DM\t" + dm.from + "\t" + m.first + "\t" + dm.message)) break;
+			box.pop_front();
+		}
+		if (box.empty()) continue;
+
+		std::lock_guard<std::mutex> lock(mx);
+		std::deque<ParkedDM>& current = mailboxes[m.first];
+		current.insert(current.begin(), box.begin(), box.end()); // Keep them ahead of anything parked meanwhile
+	}
+}
+
+bool Cluster::hasUser(const std::string& user) {
+	std::lock_guard<std::mutex> lock(mx);
+	return remoteUsers.find(user) != remoteUsers.end();
+}
+
+void Cluster::appendUsers(std::vector<std::string>& out) {
+	std::lock_guard<std::mutex> lock(mx);
+	for (const auto& u : remoteUsers) out.push_back(u.first);
+}
+
+// Keeps one outgoing connection to a peer open, redialing every second while it's down.
+// The peer answers our HELLO with its own, which tells us which node is behind this address.
+// After that we send our roster, then write whatever gets queued for the peer until the connection closes.
+void Cluster::dial(Peer* peer) {
+	while (running.load()) {
+		SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(peer->port);
+		std::string peerNode;
+		std::string buf;
+		bool ok = s != INVALID_SOCKET
+			&& inet_pton(AF_INET, peer->host.c_str(), &address.sin_addr) > 0
+			&& connect(s, (sockaddr*)&address, sizeof(address)) != SOCKET_ERROR
+			&& busSend(s, "HELLO\t" + node + "\n");
+		if (ok) {
+			std::string line;
+			ok = busReadLine(s, buf, line) && line.rfind("HELLO\t", 0) == 0;
+			if (ok) peerNode = line.substr(6);
+		}
+
+		if (ok) {
+			{
+				std::lock_guard<std::mutex> lock(mx);
+				peerNodes[peerNode] = peer;
+			}
+			{
+				// Taking the roster under the peer lock means any JOIN or LEAVE that misses it is sent after it.
+				std::lock_guard<std::mutex> lock(peer->mx);
+				peer->socket = s;
+				peer->connected = true;
+				std::string roster = "ROSTER";
+				for (const auto& u : handlers.localUsers()) roster += "\t" + u;
+				peer->outgoing = roster + "\n";
+			}
+			std::cout << "Bus connected to " << peerNode << " (" << peer->address << ")" << std::endl;
+			flushMailboxes();
+
+			// The peer never sends on this connection after its HELLO, so it turning readable means it closed
+			std::string writing;
+			while (running.load()) {
+				{
+					std::unique_lock<std::mutex> lock(peer->mx);
+					peer->wake.wait_for(lock, std::chrono::milliseconds(100), [&] { return !peer->outgoing.empty() || !peer->connected || !running.load(); });
+					if (!peer->connected) break;
+					std::swap(writing, peer->outgoing);
+				}
+				if (!writing.empty() && !busSend(s, writing)) break;
+				writing.clear();
+				if (hungUp(s)) break;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(peer->mx);
+				peer->connected = false;
+				peer->socket = INVALID_SOCKET;
+				peer->outgoing.clear();
+			}
+			{
+				std::lock_guard<std::mutex> lock(mx);
+				auto it = peerNodes.find(peerNode);
+				if (it != peerNodes.end() && it->second == peer) peerNodes.erase(it);
+			}
+			std::cout << "Bus lost " << peerNode << " (" << peer->address << ")" << std::endl;
+		}
+		if (s != INVALID_SOCKET) closesocket(s);
+
+		for (int i = 0; i < 10 && running.load(); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+}
+
+void Cluster::acceptLoop() {
+	while (running.load()) {
+		SOCKET s = accept(listener, nullptr, nullptr);
+		if (s == INVALID_SOCKET) continue;
+		std::thread(&Cluster::readPeer, this, s).detach();
+	}
+}
+
+// Reads bus messages coming from one peer node. When the connection closes, every user
+// owned by that node is dropped from the roster.
+void Cluster::readPeer(SOCKET s) {
+	std::string buf;
+	std::string line;
+	if (!busReadLine(s, buf, line) || line.rfind("HELLO\t", 0) != 0 || !busSend(s, "HELLO\t" + node + "\n")) {
+		closesocket(s);
+		return;
+	}
+	std::string from = line.substr(6);
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		links[from]++;
+	}
+
+	while (running.load() && busReadLine(s, buf, line)) {
+		handle(from, splitFields(line, fieldCount(line)));
+	}
+	closesocket(s);
+
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		last = --links[from] == 0;
+		if (last) links.erase(from);
+	}
+	if (last) dropNode(from); // A newer connection from the same node keeps it alive
+}
+
+void Cluster::handle(const std::string& from, const std::vector<std::string>& fields) {
+	const std::string& type = fields[0];
+
+	if (type == "ALL" && fields.size() == 2) {
+		handlers.deliverAll(fields[1]);
+	}
+	else if (type == "ROOM" && fields.size() == 3) {
+		handlers.deliverRoom(fields[1], fields[2]);
+	}
+	else if (type == "DM" && fields.size() == 4) {
+		receiveDM(fields[1], fields[2], fields[3]);
+	}
+	else if (type == "SYS" && fields.size() == 3) {
+		handlers.deliverSystem(fields[1], fields[2]);
+	}
+	else if (type == "JOIN" && fields.size() == 2) {
+		claim(fields[1], from);
+		handlers.presenceChanged({});
+		flushMailboxes();
+	}
+	else if (type == "LEAVE" && fields.size() == 2) {
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			auto it = remoteUsers.find(fields[1]);
+			if (it != remoteUsers.end() && it->second == from) {
+				remoteUsers.erase(it);
+				mailboxes.erase(fields[1]);
+			}
+		}
+		handlers.presenceChanged({});
+	}
+	else if (type == "ROSTER") {
+		// A full roster replaces what we had for the node. Anyone missing left while the link was down.
+		std::vector<std::string> lost;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			for (auto it = remoteUsers.begin(); it != remoteUsers.end();) {
+				if (it->second == from && std::find(fields.begin() + 1, fields.end(), it->first) == fields.end()) {
+					lost.push_back(it->first);
+					mailboxes.erase(it->first);
+					it = remoteUsers.erase(it);
+				}
+				else ++it;
+			}
+		}
+		for (size_t i = 1; i < fields.size(); i++) {
+			if (!fields[i].empty()) claim(fields[i], from);
+		}
+		handlers.presenceChanged(lost);
+		flushMailboxes();
+	}
+}
+
+// Records that a user is on node from, unless someone else keeps the name: a node with a lower name
+// that claimed it too, or a local session when this node's name is lower. When from wins over a local
+// session, that session is evicted. The entry goes in before the local check, and the login check
+// takes the same locks the other way round (server, then cluster), so a login that races a claim sees one or the other.
+void Cluster::claim(const std::string& user, const std::string& from) {
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = remoteUsers.find(user);
+		if (it != remoteUsers.end() && it->second != from && it->second < from) return; // from drops its session
+		remoteUsers[user] = from;
+	}
+	if (!handlers.hasLocalUser(user)) return;
+	if (from < node) {
+		std::cout << "Node " << from << " has " << user << " too and keeps the name" << std::endl;
+		handlers.evictLocal(user);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mx); // This node keeps it, from drops its session once our JOIN or ROSTER gets there
+	auto it = remoteUsers.find(user);
+	if (it != remoteUsers.end() && it->second == from) remoteUsers.erase(it);
+}
+
+void Cluster::dropNode(const std::string& nodeName) {
+	std::vector<std::string> lost;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		for (auto it = remoteUsers.begin(); it != remoteUsers.end();) {
+			if (it->second == nodeName) {
+				lost.push_back(it->first);
+				mailboxes.erase(it->first);
+				it = remoteUsers.erase(it);
+			}
+			else ++it;
+		}
+	}
+	if (!lost.empty()) handlers.presenceChanged(lost);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Links several server nodes with a TCP bus so they act as one chat server.
+// Every node dials every peer it's given and only writes on the connections it dialed,
+// the connections it accepts are only read from. Bus messages are tab separated lines:
+//   HELLO <node>               first line on a new connection
+//   ROSTER <user> <user> ...   every user on the sending node, sent right after HELLO
+//   JOIN <user> / LEAVE <user> presence changes
+// Each node only checks its own roster when a user logs in, so two nodes can let the same name in at once.
+// The lower node name keeps it, and the other node disconnects its session when the JOIN or ROSTER
+// of the winner reaches it.
+//   ALL <line>                 broadcast, sent once per node and delivered to its own clients
+//   ROOM <room> <line>         room message, delivered to the node's own subscribers of the room
+//   DM <from> <to> <message>   direct message, sent only to the node <to> is on
+//   SYS <to> <line>            line for one user, used to report a DM that couldn't be delivered
+//
+// Publishing only queues the line for the peer. Each peer's dialer thread writes its queue, so a slow
+// node holds up its own link and nothing else, and the reactor threads never block on the bus.
+//
+// Presence goes to every node, since each one needs the whole roster for USERS and "User not found", so a
+// DM goes straight to the node the target is connected to, in one hop. When the link to that node is down
+// the sending node holds the DM in a mailbox until the link is back.
+class Cluster {
+public:
+	// Callbacks into the server. They are called from bus threads without any cluster lock held.
+	struct Handlers {
+		std::function<void(const std::string& line)> deliverAll;
+		std::function<void(const std::string& room, const std::string& line)> deliverRoom;
+		std::function<bool(const std::string& from, const std::string& to, const std::string& message)> deliverDM;
+		std::function<void(const std::string& to, const std::string& line)> deliverSystem;
+		// Called when the set of remote users changes. lost holds users that went away without a LEAVE,
+		// because their node dropped off the bus, so the server has to announce them itself.
+		std::function<void(const std::vector<std::string>& lost)> presenceChanged;
+		std::function<std::vector<std::string>()> localUsers;
+		std::function<bool(const std::string& user)> hasLocalUser;
+		// Another node won the name of a local user (see claim). The session gets an error and is disconnected.
+		std::function<void(const std::string& user)> evictLocal;
+	};
+
+	~Cluster();
+
+	// Listens for peers on busPort and starts dialing every "host:port" in peers.
+	bool start(const std::string& node, unsigned short busPort, const std::vector<std::string>& peers, Handlers h);
+	void stop();
+	bool enabled() const { return running.load(); }
+	const std::string& nodeName() const { return node; }
+
+	void publishJoin(const std::string& user);
+	void publishLeave(const std::string& user);
+	void publishAll(const std::string& line);
+	void publishRoom(const std::string& room, const std::string& line);
+
+	enum class DMResult { Sent, NoSuchUser };
+
+	// Sends a DM to the node the target is on, or holds it until that node can be reached.
+	DMResult sendDM(const std::string& from, const std::string& to, const std::string& message);
+
+	bool hasUser(const std::string& user);
+	void appendUsers(std::vector<std::string>& out);
+
+private:
+	struct Peer {
+		std::string address;
+		std::string host;
+		unsigned short port = 0;
+		std::mutex mx;
+		std::condition_variable wake; // Something was queued, or the connection is going away
+		SOCKET socket = INVALID_SOCKET;
+		bool connected = false;
+		std::string outgoing; // Lines waiting for the dialer to write them, only kept while connected
+		std::thread dialer;
+	};
+
+	bool sendTo(Peer& peer, const std::string& line);
+	void sendToAll(const std::string& line);
+	bool sendToNode(const std::string& nodeName, const std::string& line);
+	void dial(Peer* peer);
+	void acceptLoop();
+	void readPeer(SOCKET s);
+	void handle(const std::string& from, const std::vector<std::string>& fields);
+	void claim(const std::string& user, const std::string& from);
+	void dropNode(const std::string& nodeName);
+
+	struct ParkedDM {
+		std::string from;
+		std::string message;
+		std::chrono::steady_clock::time_point at;
+	};
+
+	void receiveDM(const std::string& from, const std::string& to, const std::string& message);
+	void routeSystem(const std::string& to, const std::string& line);
+	void park(const std::string& from, const std::string& to, const std::string& message);
+	void flushMailboxes();
+
+	std::string node;
+	Handlers handlers;
+	std::atomic<bool> running{ false };
+	SOCKET listener = INVALID_SOCKET;
+	std::thread acceptor;
+	std::vector<std::unique_ptr<Peer>> peers;
+
+	std::mutex mx; // Guards the maps below
+	std::unordered_map<std::string, std::string> remoteUsers; // User -> node that owns them
+	std::unordered_map<std::string, Peer*> peerNodes; // Node name -> outgoing connection to it
+	std::unordered_map<std::string, int> links; // Node name -> incoming connections from it
+	std::unordered_map<std::string, std::deque<ParkedDM>> mailboxes; // User -> DMs waiting for a route to them
+};
+
+const size_t peerQueueLimit = 16 * 1024 * 1024; // Bytes queued for a peer before its link counts as stuck
+const size_t mailboxLimit = 100;
+const std::chrono::seconds mailboxTtl(30);
@@ -0,0 +1,142 @@
+#include "fanout.h"
+
+#include <algorithm>
+
+FanoutPool::~FanoutPool() {
+	stop();
+}
+
+void FanoutPool::start(unsigned int threads) {
+	stop();
+	stopping = false;
+	queues.clear();
+	for (unsigned int i = 0; i < threads; i++)
+		queues.push_back(std::make_unique<Queue>());
+	for (unsigned int i = 0; i < threads; i++)
+		workers.emplace_back(&FanoutPool::worker, this, (size_t)i);
+}
+
+void FanoutPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMx);
+		stopping = true;
+	}
+	sleepCv.notify_all();
+	for (auto& t : workers) {
+		if (t.joinable()) t.join();
+	}
+	workers.clear();
+}
+
+// Takes the newest task from the worker's own queue.
+bool FanoutPool::popOwn(size_t index, Task& out) {
+	Queue& q = *queues[index];
+	std::lock_guard<std::mutex> lock(q.mx);
+	if (q.tasks.empty()) return false;
+	out = q.tasks.back();
+	q.tasks.pop_back();
+	queued.fetch_sub(1);
+	return true;
+}
+
+// Takes the oldest task from any queue, starting at the given one.
+bool FanoutPool::steal(size_t start, Task& out) {
+	for (size_t i = 0; i < queues.size(); i++) {
+		Queue& q = *queues[(start + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(q.mx);
+		if (q.tasks.empty()) continue;
+		out = q.tasks.front();
+		q.tasks.pop_front();
+		queued.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+// Runs a chunk and, once the last chunk of its job is done, wakes the caller of run() or finishes a submitted job.
+// A run() job lives on the caller's stack, so it can't be touched after the count reaches zero and the lock is released.
+void FanoutPool::execute(const Task& task) {
+	Job* job = task.job;
+	(*job->fn)(task.begin, task.end);
+	{
+		std::lock_guard<std::mutex> lock(job->mx);
+		if (--job->remaining > 0) return;
+		if (!job->done) {
+			job->cv.notify_all();
+			return;
+		}
+	}
+	job->done();
+	delete job;
+}
+
+void FanoutPool::worker(size_t index) {
+	while (true) {
+		Task task;
+		if (popOwn(index, task) || steal(index + 1, task)) {
+			execute(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMx);
+		sleepCv.wait(lock, [&] { return stopping || queued.load() > 0; });
+		if (stopping) return;
+	}
+}
+
+void FanoutPool::run(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& fn) {
+	if (count == 0) return;
+	if (chunkSize == 0) chunkSize = count;
+
+	if (queues.empty() || count <= chunkSize) {
+		fn(0, count); // Nothing to split
+		return;
+	}
+
+	Job job;
+	job.fn = &fn;
+	size_t q = deal(job, count, chunkSize);
+
+	// Help with the work instead of sitting idle, then wait for the chunks still running on workers.
+	Task task;
+	while (steal(q, task)) {
+		execute(task);
+		std::lock_guard<std::mutex> lock(job.mx);
+		if (job.remaining == 0) break;
+	}
+
+	std::unique_lock<std::mutex> lock(job.mx);
+	job.cv.wait(lock, [&] { return job.remaining == 0; });
+}
+
+void FanoutPool::submit(size_t count, size_t chunkSize, std::function<void(size_t, size_t)> fn, std::function<void()> done) {
+	if (queues.empty() || count == 0) {
+		if (count > 0) fn(0, count);
+		done();
+		return;
+	}
+	if (chunkSize == 0) chunkSize = count;
+
+	Job* job = new Job(); // Deleted by execute() after the last chunk
+	job->ownFn = std::move(fn);
+	job->fn = &job->ownFn;
+	job->done = std::move(done);
+	deal(*job, count, chunkSize);
+}
+
+// Deals the chunks of a job out round robin, starting at a different queue each time so concurrent jobs
+// spread out, and wakes the workers. Returns the queue after the last one dealt to.
+size_t FanoutPool::deal(Job& job, size_t count, size_t chunkSize) {
+	job.remaining = (count + chunkSize - 1) / chunkSize;
+	size_t q = nextQueue.fetch_add(1);
+	for (size_t begin = 0; begin < count; begin += chunkSize) {
+		Queue& queue = *queues[q++ % queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mx);
+		queue.tasks.push_back({ &job, begin, std::min(begin + chunkSize, count) });
+		queued.fetch_add(1);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMx); // Pairs with the wait in worker() so the wakeup can't be missed
+	}
+	sleepCv.notify_all();
+	return q;
+}
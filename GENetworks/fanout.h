@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool used to split the fan-out of a single message across threads.
+// Every worker has its own queue of chunks. Workers pop from the back of their own queue and steal
+// from the front of the others when they run dry, so chunks that take longer get balanced out.
+class FanoutPool {
+public:
+	~FanoutPool();
+
+	// Starts the worker threads. With 0 workers run() does all the work on the calling thread.
+	void start(unsigned int threads);
+	void stop();
+
+	size_t workerCount() const { return workers.size(); }
+
+	// Calls fn(begin, end) for every chunk of [0, count), chunkSize items at a time.
+	// The calling thread helps out and only returns once every chunk has been run.
+	void run(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& fn);
+
+	// Like run(), but returns straight away and calls done() on whichever thread runs the last chunk.
+	// For threads with better things to do than wait, like the event loop's. With no workers it's all done here.
+	void submit(size_t count, size_t chunkSize, std::function<void(size_t, size_t)> fn, std::function<void()> done);
+
+private:
+	struct Job {
+		const std::function<void(size_t, size_t)>* fn = nullptr;
+		size_t remaining = 0;
+		std::mutex mx;
+		std::condition_variable cv;
+		std::function<void(size_t, size_t)> ownFn; // A submitted job owns its function, and itself
+		std::function<void()> done;
+	};
+
+	struct Task {
+		Job* job;
+		size_t begin;
+		size_t end;
+	};
+
+	struct Queue {
+		std::mutex mx;
+		std::deque<Task> tasks;
+	};
+
+	size_t deal(Job& job, size_t count, size_t chunkSize);
+	bool popOwn(size_t index, Task& out);
+	bool steal(size_t start, Task& out);
+	void execute(const Task& task);
+	void worker(size_t index);
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> queued{ 0 };
+	std::atomic<size_t> nextQueue{ 0 };
+	std::mutex sleepMx;
+	std::condition_variable sleepCv;
+	bool stopping = false;
+};
@@ -0,0 +1,218 @@
+#include "handoff.h"
+
+#include <windows.h>
+#include <afunix.h>
+#include <sddl.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#pragma comment(lib, "Advapi32.lib")
+
+namespace {
+
+const uint32_t handoffMagic = 0x47454e48; // "GENH"
+const char handoffAck = 'K';
+const DWORD helloTimeoutMs = 5000; // A successor sends its hello as soon as it connects
+
+bool sendBytes(SOCKET s, const char* data, size_t len) {
+	size_t sentSum = 0;
+	while (sentSum < len) {
+		int sent = send(s, data + sentSum, (int)(len - sentSum), 0);
+		if (sent == SOCKET_ERROR) return false;
+		sentSum += sent;
+	}
+	return true;
+}
+
+bool receiveBytes(SOCKET s, char* data, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		int received = recv(s, data + got, (int)(len - got), 0);
+		if (received <= 0) return false;
+		got += received;
+	}
+	return true;
+}
+
+// The message is built in memory and sent in one go. Both ends run on the same machine, so numbers go in native byte order.
+void putU32(std::string& out, uint32_t v) {
+	out.append((const char*)&v, sizeof(v));
+}
+
+void putString(std::string& out, const std::string& s) {
+	putU32(out, (uint32_t)s.size());
+	out += s;
+}
+
+void putInfo(std::string& out, const WSAPROTOCOL_INFOW& info) {
+	out.append((const char*)&info, sizeof(info));
+}
+
+// Reads from a received message, failing once it would run past the end.
+struct Reader {
+	const std::string& in;
+	size_t pos = 0;
+
+	bool u32(uint32_t& v) {
+		if (in.size() - pos < sizeof(v)) return false;
+		std::memcpy(&v, in.data() + pos, sizeof(v));
+		pos += sizeof(v);
+		return true;
+	}
+	bool string(std::string& s) {
+		uint32_t len;
+		if (!u32(len) || in.size() - pos < len) return false;
+		s.assign(in, pos, len);
+		pos += len;
+		return true;
+	}
+	bool info(WSAPROTOCOL_INFOW& info) {
+		if (in.size() - pos < sizeof(info)) return false;
+		std::memcpy(&info, in.data() + pos, sizeof(info));
+		pos += sizeof(info);
+		return true;
+	}
+};
+
+// The executable a process was started from, or empty if it can't be looked at.
+std::wstring imageOf(DWORD pid) {
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (!process) return L"";
+	wchar_t path[MAX_PATH * 4];
+	DWORD len = MAX_PATH * 4;
+	BOOL ok = QueryFullProcessImageNameW(process, 0, path, &len);
+	CloseHandle(process);
+	return ok ? std::wstring(path, len) : L"";
+}
+
+SOCKET socketFrom(WSAPROTOCOL_INFOW& info) {
+	return WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+}
+
+}
+
+bool restrictToOwner(const std::string& path) {
+	PSECURITY_DESCRIPTOR descriptor = nullptr;
+	// Protected DACL with a single entry: full access for the owner, nothing inherited from the directory
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;FA;;;OW)", SDDL_REVISION_1, &descriptor, nullptr)) return false;
+	BOOL ok = SetFileSecurityA(path.c_str(), DACL_SECURITY_INFORMATION, descriptor);
+	LocalFree(descriptor);
+	return ok;
+}
+
+bool receiveSuccessor(SOCKET channel, DWORD& pid) {
+	DWORD timeout = helloTimeoutMs;
+	setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	uint32_t hello[2];
+	if (!receiveBytes(channel, (char*)hello, sizeof(hello)) || hello[0] != handoffMagic) return false;
+
+	// The id in the hello is only a claim, the socket knows who is really on the other end
+	ULONG peer = 0;
+	DWORD bytes = 0;
+	if (WSAIoctl(channel, SIO_AF_UNIX_GETPEERPID, nullptr, 0, &peer, sizeof(peer), &bytes, nullptr, nullptr) == SOCKET_ERROR || peer != hello[1]) {
+		std::cerr << "Handoff refused: the peer is not process " << hello[1] << std::endl;
+		return false;
+	}
+	std::wstring image = imageOf(peer);
+	if (image.empty() || _wcsicmp(image.c_str(), imageOf(GetCurrentProcessId()).c_str()) != 0) {
+		std::cerr << "Handoff refused: process " << peer << " is not running this server's executable" << std::endl;
+		return false;
+	}
+	pid = peer;
+	return true;
+}
+
+// Message: magic, the listener, a session count, then per session its socket, username, unread bytes and rooms.
+bool sendHandoff(SOCKET channel, DWORD pid, SOCKET listener, const std::vector<HandedOver>& sessions, int timeoutMs) {
+	std::string message;
+	putU32(message, handoffMagic);
+	WSAPROTOCOL_INFOW info;
+	if (WSADuplicateSocketW(listener, pid, &info) != 0) {
+		std::cerr << "Could not duplicate the listening socket: " << WSAGetLastError() << std::endl;
+		return false;
+	}
+	putInfo(message, info);
+
+	std::string body;
+	uint32_t count = 0;
+	for (const auto& session : sessions) {
+		if (WSADuplicateSocketW(session.socket, pid, &info) != 0) continue;
+		putInfo(body, info);
+		putString(body, session.username);
+		putString(body, session.unread);
+		putU32(body, (uint32_t)session.rooms.size());
+		for (const auto& room : session.rooms) putString(body, room);
+		count++;
+	}
+	putU32(message, count);
+	message += body;
+
+	uint32_t len = (uint32_t)message.size();
+	if (!sendBytes(channel, (const char*)&len, sizeof(len)) || !sendBytes(channel, message.data(), message.size())) return false;
+
+	DWORD timeout = (DWORD)timeoutMs;
+	setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	char ack = 0;
+	return recv(channel, &ack, 1, 0) == 1 && ack == handoffAck;
+}
+
+SOCKET receiveHandoff(const std::string& path, SOCKET& listener, std::vector<HandedOver>& sessions) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Invalid handoff path: " << path << std::endl;
+		return INVALID_SOCKET;
+	}
+	std::copy(path.begin(), path.end(), address.sun_path);
+
+	SOCKET channel = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (channel == INVALID_SOCKET || connect(channel, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+		std::cerr << "Could not reach the server to take over at " << path << ": " << WSAGetLastError() << std::endl;
+		if (channel != INVALID_SOCKET) closesocket(channel);
+		return INVALID_SOCKET;
+	}
+
+	uint32_t hello[2] = { handoffMagic, (uint32_t)GetCurrentProcessId() };
+	uint32_t len = 0;
+	std::string message;
+	if (sendBytes(channel, (const char*)hello, sizeof(hello)) && receiveBytes(channel, (char*)&len, sizeof(len))) {
+		message.resize(len);
+		if (!receiveBytes(channel, &message[0], len)) message.clear();
+	}
+
+	Reader in{ message };
+	uint32_t magic = 0, count = 0;
+	WSAPROTOCOL_INFOW info;
+	if (!in.u32(magic) || magic != handoffMagic || !in.info(info) || !in.u32(count)) {
+		std::cerr << "Handoff from " << path << " failed" << std::endl;
+		closesocket(channel);
+		return INVALID_SOCKET;
+	}
+	listener = socketFrom(info);
+	if (listener == INVALID_SOCKET) {
+		std::cerr << "Could not take over the listening socket: " << WSAGetLastError() << std::endl;
+		closesocket(channel);
+		return INVALID_SOCKET;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		HandedOver session;
+		uint32_t rooms = 0;
+		if (!in.info(info) || !in.string(session.username) || !in.string(session.unread) || !in.u32(rooms)) break;
+		session.rooms.resize(rooms);
+		bool complete = true;
+		for (auto& room : session.rooms) complete = complete && in.string(room);
+		if (!complete) break;
+		session.socket = socketFrom(info);
+		if (session.socket != INVALID_SOCKET) sessions.push_back(std::move(session));
+	}
+	return channel;
+}
+
+void confirmHandoff(SOCKET channel) {
+	sendBytes(channel, &handoffAck, 1);
+	char rest;
+	while (recv(channel, &rest, 1, 0) > 0) {} // The old process exiting closes it
+	closesocket(channel);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <winsock2.h>
+#include <string>
+#include <vector>
+
+// Hot restart. A running server hands its listening socket and its live connections to a new process, so an
+// upgrade doesn't drop every client at once and have them all reconnect together.
+// The new process connects to the old one's handoff socket (a Unix domain socket) and sends its process id.
+// The old one stops reading, flushes what it owes each client, duplicates its sockets into the new process
+// with WSADuplicateSocket and sends them over with what each session needs to carry on. The new process
+// starts the sessions and answers, and the old one exits, which closes the channel.
+
+// A connection passed to the new process.
+struct HandedOver {
+	SOCKET socket = INVALID_SOCKET;
+	std::string username; // Empty if it hadn't logged in yet
+	std::vector<std::string> rooms;
+	std::string unread; // Bytes read from the socket but not handled yet
+};
+
+// Old process side. Lets only the account running this server connect to the handoff socket at path.
+// Call it between bind and listen, so nobody else can get in before it applies.
+bool restrictToOwner(const std::string& path);
+
+// Old process side. Reads the new process's id from a channel it accepted, giving up after a few seconds.
+// Refuses the successor unless the id is the socket peer's and that process runs this same executable, since
+// whoever it names gets a copy of every socket.
+bool receiveSuccessor(SOCKET channel, DWORD& pid);
+
+// Old process side. Duplicates listener and every session's socket for pid, sends them on the channel and
+// waits up to timeoutMs for the new process to say it has them. A session whose socket can't be duplicated
+// is left out and its client just sees the connection drop.
+bool sendHandoff(SOCKET channel, DWORD pid, SOCKET listener, const std::vector<HandedOver>& sessions, int timeoutMs);
+
+// New process side. Connects to the handoff socket at path and takes over the old process's sockets.
+// Returns the channel, to pass to confirmHandoff once the sessions are running, or INVALID_SOCKET.
+SOCKET receiveHandoff(const std::string& path, SOCKET& listener, std::vector<HandedOver>& sessions);
+
+// New process side. Tells the old process the takeover worked and waits for it to exit, so the ports and
+// paths it still holds (Unix socket, UDP, cluster bus) are free by the time this returns.
+void confirmHandoff(SOCKET channel);
@@ -0,0 +1,222 @@
+#include "loop.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+static thread_local void* currentReactor = nullptr; // Reactor of the calling thread, if it is one
+
+static int64_t nowMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Finds a core numbered across every processor group, as --pin-cores counts them, and gives its group and
+// number within the group. Machines with more than 64 logical processors have several groups, and an
+// affinity mask only reaches the cores of one. False if there's no such core.
+static bool processorFor(unsigned int core, PROCESSOR_NUMBER& out) {
+	DWORD len = 0;
+	GetLogicalProcessorInformationEx(RelationGroup, nullptr, &len);
+	std::vector<char> buf(len);
+	auto* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buf.data();
+	if (len == 0 || !GetLogicalProcessorInformationEx(RelationGroup, info, &len)) return false;
+	const GROUP_RELATIONSHIP& groups = info->Group;
+	for (WORD g = 0; g < groups.ActiveGroupCount; g++) {
+		KAFFINITY active = groups.GroupInfo[g].ActiveProcessorMask;
+		for (BYTE bit = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+			if (!(active & ((KAFFINITY)1 << bit))) continue;
+			if (core-- > 0) continue;
+			out = {};
+			out.Group = g;
+			out.Number = bit;
+			return true;
+		}
+	}
+	return false;
+}
+
+EventLoop::~EventLoop() {
+	stop();
+}
+
+bool EventLoop::start(unsigned int threads) {
+	stop();
+	std::vector<PROCESSOR_NUMBER> processors;
+	for (unsigned int core : pinCores) {
+		PROCESSOR_NUMBER p;
+		if (!processorFor(core, p)) {
+			std::cerr << "There is no core " << core << " to pin to, this machine has "
+				<< GetActiveProcessorCount(ALL_PROCESSOR_GROUPS) << std::endl;
+			return false;
+		}
+		processors.push_back(p);
+	}
+	stopping.store(false);
+	if (threads == 0) threads = 1;
+	for (unsigned int i = 0; i < threads; i++) {
+		auto r = std::make_unique<Reactor>();
+		r->wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		r->wakeAddress.sin_family = AF_INET;
+		r->wakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		int len = sizeof(r->wakeAddress);
+		bind(r->wakeSocket, (sockaddr*)&r->wakeAddress, sizeof(r->wakeAddress));
+		getsockname(r->wakeSocket, (sockaddr*)&r->wakeAddress, &len);
+		u_long nonBlocking = 1;
+		ioctlsocket(r->wakeSocket, FIONBIO, &nonBlocking);
+		if (!processors.empty()) {
+			r->pinned = true;
+			r->processor = processors[i % processors.size()];
+			USHORT node = 0;
+			if (numa && GetNumaProcessorNodeEx(&r->processor, &node) && node != 0xFFFF) r->node = node;
+		}
+		reactors.push_back(std::move(r));
+	}
+	for (auto& r : reactors) r->thread = std::thread(&EventLoop::loop, this, r.get());
+	return true;
+}
+
+void EventLoop::stop() {
+	stopping.store(true);
+	for (auto& r : reactors) wake(*r);
+	for (auto& r : reactors) {
+		if (r->thread.joinable()) r->thread.join();
+		closesocket(r->wakeSocket);
+	}
+	reactors.clear();
+}
+
+void EventLoop::watch(SOCKET s, short events, int timeoutMs, Waiter* waiter) {
+	add(reactorFor(s), { s, events, timeoutMs > 0 ? nowMs() + timeoutMs : 0, waiter });
+}
+
+void EventLoop::post(SOCKET s, Waiter* waiter) {
+	Reactor& r = reactorFor(s);
+	bool sleeping;
+	{
+		std::lock_guard<std::mutex> lock(r.mx);
+		r.posted.push_back(waiter);
+		sleeping = r.asleep;
+		r.asleep = false;
+	}
+	if (sleeping) wake(r);
+}
+
+void EventLoop::cancelReads() {
+	readsCancelled.store(true);
+	for (auto& r : reactors) wake(*r);
+}
+
+// A watch added from the reactor's own thread goes straight into its list, it's picked up on the next round.
+void EventLoop::add(Reactor& r, const Watch& w) {
+	if (currentReactor == &r) {
+		r.watches.push_back(w);
+		return;
+	}
+	bool sleeping;
+	{
+		std::lock_guard<std::mutex> lock(r.mx);
+		r.incoming.push_back(w);
+		sleeping = r.asleep;
+		r.asleep = false;
+	}
+	if (sleeping) wake(r);
+}
+
+void EventLoop::wake(Reactor& r) {
+	char b = 0;
+	sendto(r.wakeSocket, &b, 1, 0, (sockaddr*)&r.wakeAddress, sizeof(r.wakeAddress));
+}
+
+// One round: take in new watches and posts, poll everything, then run what became ready or timed out.
+// Ready waiters run after the scan, since they usually add a new watch for their socket straight away.
+void EventLoop::loop(Reactor* rp) {
+	Reactor& r = *rp;
+	currentReactor = &r;
+	if (r.pinned) {
+		GROUP_AFFINITY affinity = {};
+		affinity.Group = r.processor.Group;
+		affinity.Mask = (KAFFINITY)1 << r.processor.Number;
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+	}
+	while (!stopping) {
+		{
+			std::lock_guard<std::mutex> lock(r.mx);
+			r.watches.insert(r.watches.end(), r.incoming.begin(), r.incoming.end());
+			r.incoming.clear();
+			std::swap(r.run, r.posted);
+		}
+		for (Waiter* w : r.run) w->ready(false);
+		r.run.clear();
+
+		r.fds.clear();
+		WSAPOLLFD wakeFd = {};
+		wakeFd.fd = r.wakeSocket;
+		wakeFd.events = POLLRDNORM;
+		r.fds.push_back(wakeFd);
+		int64_t nearest = 0;
+		bool cancelled = readsCancelled.load();
+		bool cancelledRead = false;
+		for (const Watch& w : r.watches) {
+			WSAPOLLFD fd = {};
+			fd.fd = w.socket;
+			fd.events = w.events;
+			r.fds.push_back(fd);
+			if (w.deadline != 0 && (nearest == 0 || w.deadline < nearest)) nearest = w.deadline;
+			if (cancelled && (w.events & POLLRDNORM)) cancelledRead = true;
+		}
+
+		int timeout = -1;
+		if (nearest != 0) timeout = (int)std::max<int64_t>(0, nearest - nowMs());
+		if (cancelledRead) timeout = 0;
+		int n = 0;
+		if (busyPollUs <= 0 || timeout == 0 || !spin(r, n)) {
+			{
+				std::lock_guard<std::mutex> lock(r.mx);
+				if (!r.posted.empty() || !r.incoming.empty()) timeout = 0; // More came in while we ran the posts
+				else r.asleep = true;
+			}
+			n = WSAPoll(r.fds.data(), (ULONG)r.fds.size(), timeout);
+			{
+				std::lock_guard<std::mutex> lock(r.mx);
+				r.asleep = false;
+			}
+		}
+		if (n < 0) continue;
+		if (r.fds[0].revents != 0) {
+			char drain[64];
+			while (recv(r.wakeSocket, drain, sizeof(drain), 0) > 0) {}
+		}
+
+		int64_t now = nowMs();
+		size_t kept = 0;
+		for (size_t i = 0; i < r.watches.size(); i++) {
+			Watch w = r.watches[i];
+			bool fired = r.fds[i + 1].revents != 0 || (cancelled && (w.events & POLLRDNORM));
+			if (fired || (w.deadline != 0 && w.deadline <= now)) {
+				w.deadline = fired ? 0 : -1; // -1 marks a timeout
+				r.due.push_back(w);
+			}
+			else r.watches[kept++] = w;
+		}
+		r.watches.resize(kept);
+		for (const Watch& w : r.due) w.waiter->ready(w.deadline == -1);
+		r.due.clear();
+	}
+	currentReactor = nullptr;
+}
+
+// Polls without sleeping for up to busyPollUs. Returns true as soon as a socket is ready (n is what WSAPoll
+// returned) or another thread handed over work, false once the time is up and the reactor should sleep.
+bool EventLoop::spin(Reactor& r, int& n) {
+	auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(busyPollUs);
+	do {
+		n = WSAPoll(r.fds.data(), (ULONG)r.fds.size(), 0);
+		if (n != 0) return true;
+		{
+			std::lock_guard<std::mutex> lock(r.mx);
+			if (!r.posted.empty() || !r.incoming.empty()) return true;
+		}
+		YieldProcessor();
+	} while (std::chrono::steady_clock::now() < until);
+	return false;
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <winsock2.h>
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Something waiting on the event loop. ready() runs on the loop thread that owns the socket,
+// with timedOut set if the wait's time limit ran out first.
+class Waiter {
+public:
+	virtual void ready(bool timedOut) = 0;
+
+protected:
+	~Waiter() = default;
+};
+
+// Event loop the client sessions run on. A handful of reactor threads each poll their share of the
+// sockets with WSAPoll and run whatever was waiting on them. A socket always belongs to the same
+// thread, so everything done for one session happens on one thread, one thing at a time.
+class EventLoop {
+public:
+	~EventLoop();
+
+	// Returns false if pinCores names a core this machine doesn't have.
+	bool start(unsigned int threads);
+	void stop();
+
+	bool running() const { return !reactors.empty(); }
+
+	// Low latency mode, set before start(). Reactor i is pinned to pinCores[i % size] when the list isn't
+	// empty, cores being numbered across all processor groups. With numa set a pinned reactor takes the
+	// NUMA node of its core, see nodeFor. A reactor with
+	// busyPollUs keeps polling that long without sleeping before WSAPoll blocks, trading a core for the
+	// wakeup latency; work handed over from other threads is picked up while it spins too.
+	std::vector<unsigned int> pinCores;
+	bool numa = false;
+	int busyPollUs = 0;
+
+	// NUMA node of the reactor that owns s, 0 unless numa is on.
+	unsigned int nodeFor(SOCKET s) { return reactors.empty() ? 0 : reactorFor(s).node; }
+
+	// Calls waiter->ready() once s is readable (POLLRDNORM) or writable (POLLWRNORM),
+	// or after timeoutMs if that comes first. 0 waits without a limit.
+	void watch(SOCKET s, short events, int timeoutMs, Waiter* waiter);
+
+	// Calls waiter->ready() on the thread that owns s as soon as it gets to it.
+	void post(SOCKET s, Waiter* waiter);
+
+	// From now on every read watch fires straight away, including ones added later, so sessions waiting
+	// for input wake up and notice the server is stopping. Write watches carry on as normal.
+	void cancelReads();
+
+private:
+	struct Watch {
+		SOCKET socket;
+		short events;
+		int64_t deadline; // 0 for none
+		Waiter* waiter;
+	};
+
+	struct Reactor {
+		std::thread thread;
+		SOCKET wakeSocket = INVALID_SOCKET; // Loopback UDP socket, a datagram to itself wakes WSAPoll
+		sockaddr_in wakeAddress = {};
+		std::mutex mx;
+		std::vector<Watch> incoming; // Added by other threads
+		std::vector<Waiter*> posted;
+		bool asleep = false; // In WSAPoll, so new work has to wake it
+		bool pinned = false;
+		PROCESSOR_NUMBER processor = {}; // Core it's pinned to
+		unsigned int node = 0;
+
+		// Only touched by the reactor's own thread
+		std::vector<Watch> watches;
+		std::vector<WSAPOLLFD> fds;
+		std::vector<Watch> due;
+		std::vector<Waiter*> run;
+	};
+
+	Reactor& reactorFor(SOCKET s) { return *reactors[((size_t)s >> 2) % reactors.size()]; } // Handles are multiples of 4
+	void add(Reactor& r, const Watch& w);
+	void wake(Reactor& r);
+	void loop(Reactor* r);
+	bool spin(Reactor& r, int& n);
+
+	std::vector<std::unique_ptr<Reactor>> reactors;
+	std::atomic<bool> stopping{ false };
+	std::atomic<bool> readsCancelled{ false };
+};
+
+// Return type of a coroutine nobody waits for, like a client session. It starts running right away,
+// goes on from wherever it was resumed, and frees itself when it finishes.
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
@@ -0,0 +1,49 @@
+#include "pool.h"
+
+BufferPool::Node::Node() {
+	for (auto& c : classes) c.free.reserve(keepPerClass); // Returning a buffer never has to grow the list
+}
+
+BufferPool::BufferPool() {
+	setNodes(1);
+}
+
+void BufferPool::setNodes(unsigned int count) {
+	if (count == 0) count = 1;
+	lists.clear();
+	for (unsigned int i = 0; i < count; i++) lists.push_back(std::make_unique<Node>());
+}
+
+std::string BufferPool::take(size_t size, unsigned int node) {
+	size_t index = 0;
+	while (index < classCount && classSize(index) < size) index++;
+	if (index == classCount) {
+		std::string buf;
+		buf.reserve(size);
+		return buf;
+	}
+	{
+		SizeClass& c = nodeAt(node).classes[index];
+		std::lock_guard<std::mutex> lock(c.mx);
+		if (!c.free.empty()) {
+			std::string buf = std::move(c.free.back());
+			c.free.pop_back();
+			return buf;
+		}
+	}
+	std::string buf;
+	buf.reserve(classSize(index));
+	return buf;
+}
+
+// Files the buffer under the largest class it can hold, so take() never gets one that's too small.
+void BufferPool::give(std::string&& buf, unsigned int node) {
+	size_t cap = buf.capacity();
+	if (cap < classSize(0) || cap > classSize(classCount - 1) * 2) return;
+	size_t index = classCount - 1;
+	while (classSize(index) > cap) index--;
+	buf.clear();
+	SizeClass& c = nodeAt(node).classes[index];
+	std::lock_guard<std::mutex> lock(c.mx);
+	if (c.free.size() < keepPerClass) c.free.push_back(std::move(buf));
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Free lists of string buffers, one per size class. take() hands out an empty string with at least the
+// asked-for capacity and give() puts one back, so buffers that keep being filled and sent are reused
+// instead of going through malloc every time. Buffers smaller than the first class (which fit in the
+// string itself) or larger than the last one aren't kept.
+// With setNodes() there is a separate set of lists per NUMA node, so reactors on different nodes don't
+// share free lists or their locks. The buffers themselves come from the ordinary heap, which doesn't place
+// them on any node. Node 0 is used when nothing else is asked for.
+class BufferPool {
+public:
+	BufferPool();
+
+	// Call before any other thread uses the pool.
+	void setNodes(unsigned int count);
+	unsigned int nodes() const { return (unsigned int)lists.size(); }
+
+	std::string take(size_t size, unsigned int node = 0);
+	void give(std::string&& buf, unsigned int node = 0);
+
+private:
+	static const size_t classCount = 5; // 256 B, 1 KiB, 4 KiB, 16 KiB, 64 KiB
+	static const size_t keepPerClass = 1024;
+
+	static size_t classSize(size_t index) { return (size_t)256 << (2 * index); }
+
+	struct SizeClass {
+		std::mutex mx;
+		std::vector<std::string> free;
+	};
+	struct Node {
+		Node();
+		SizeClass classes[classCount];
+	};
+	Node& nodeAt(unsigned int node) { return *lists[node < lists.size() ? node : 0]; }
+
+	std::vector<std::unique_ptr<Node>> lists;
+};
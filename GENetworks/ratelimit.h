@@ -0,0 +1,45 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Lines per second a budget allows. Bursts of up to twice that go through at once. 0 means no limit.
+struct RateLimit {
+	int64_t perSecond = 0;
+};
+
+// Token bucket kept in thousandths of a token. The caller passes a millisecond clock it reads once per recv,
+// so a check is a few integer operations and never a clock read or a lock.
+struct TokenBucket {
+	int64_t rate = 0; // Thousandths of a token added per millisecond, same as tokens per second
+	int64_t capacity = 0;
+	int64_t level = 0;
+	int64_t last = 0;
+	uint64_t dropped = 0;
+
+	void configure(RateLimit limit, int64_t nowMs) {
+		rate = limit.perSecond;
+		capacity = 2 * limit.perSecond * 1000;
+		level = capacity;
+		last = nowMs;
+	}
+
+	// Takes a token if there's one. Counts the line as dropped if there isn't.
+	bool take(int64_t nowMs) {
+		if (rate == 0) return true;
+		if (nowMs != last) {
+			level = std::min(capacity, level + (nowMs - last) * rate);
+			last = nowMs;
+		}
+		if (level < 1000) {
+			dropped++;
+			return false;
+		}
+		level -= 1000;
+		return true;
+	}
+};
+
+inline int64_t steadyMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -1,34 +1,373 @@
 #include "server.h"
-// SendAll implementation to make sure all bytes are sent.
-// Takes socket to send to, the data to send and the length of the data as args
-bool sendAll(SOCKET s, const char* data, int len) {
-	int sentSum = 0;
-	while (sentSum < len) {
-		int sent = send(s, data + sentSum, len - sentSum, 0);
-		if (sent == SOCKET_ERROR) return false;
-		sentSum += sent;
+
+// Tells an outbox's writer there is something to do: the writer thread, or for a polled transport
+// the event loop, which gets the outbox posted unless a flush is already on its way.
+void wakeWriter(const std::shared_ptr<Outbox>& box) {
+	if (!box->polled) {
+		box->cv.notify_one();
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(box->mx);
+		if (box->scheduled) return;
+		box->scheduled = true;
+		box->self = box;
+	}
+	eventLoop.post(box->socket, box.get());
+}
+
+// Appends data to an outbox and wakes its writer. Returns false if the outbox is closed or its socket failed.
+// If this thread has a FlushBatch open the outbox is corked instead, and the batch wakes the writer later.
+// A large shared payload is queued by reference, anything else is copied.
+static bool enqueuePiece(const std::shared_ptr<Outbox>& box, const std::string& data, const std::shared_ptr<const std::string>& shared) {
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(box->mx);
+		if (box->closed || box->failed) return false;
+		if (currentBatch && box->corkTag != currentBatch->tag) {
+			box->corks++;
+			box->corkTag = currentBatch->tag;
+			currentBatch->corked.push_back(box);
+		}
+		wake = box->pending.empty() && box->corks == 0;
+		if (shared && shared->size() >= zeroCopyMin) {
+			box->pending.push_back({ std::string(), shared });
+		}
+		else {
+			if (box->pending.empty() || box->pending.back().shared)
+				box->pending.push_back({ bufferPool.take(std::max(data.size(), (size_t)1024), box->node), nullptr }); // Most batches fit in 1 KiB
+			std::string& bytes = box->pending.back().bytes;
+			if (bytes.size() + data.size() > bytes.capacity()) { // Grow through the pool rather than letting the string reallocate
+				std::string bigger = bufferPool.take(2 * (bytes.size() + data.size()), box->node);
+				bigger += bytes;
+				bufferPool.give(std::move(bytes), box->node);
+				bytes = std::move(bigger);
+			}
+			bytes += data;
+		}
 	}
+	if (wake) wakeWriter(box);
 	return true;
 }
-// Add a newline (\n) character to the end of a line
+
+bool enqueue(const std::shared_ptr<Outbox>& box, const std::string& data) {
+	return enqueuePiece(box, data, nullptr);
+}
+
+bool enqueue(const std::shared_ptr<Outbox>& box, const std::shared_ptr<const std::string>& payload) {
+	return enqueuePiece(box, *payload, payload);
+}
+
+FlushBatch::FlushBatch() : tag(nextBatchTag.fetch_add(1)) {
+	currentBatch = this;
+}
+
+FlushBatch::~FlushBatch() {
+	flush();
+	currentBatch = nullptr;
+}
+
+// Uncorks every outbox the batch touched. A new tag makes the next line cork them again.
+void FlushBatch::flush() {
+	for (const auto& box : corked) {
+		bool wake;
+		{
+			std::lock_guard<std::mutex> lock(box->mx);
+			wake = --box->corks == 0 && !box->pending.empty();
+		}
+		if (wake) wakeWriter(box);
+	}
+	corked.clear();
+	lines = 0;
+	tag = nextBatchTag.fetch_add(1);
+}
+
+// Writer thread of a client. Sends whatever has built up in the outbox with one gathered send, once no batch holds it corked.
+// Shared payloads are released only after the send returns. Only used for transports the event loop can't poll.
+// Exits once the outbox is closed and flushed. If a send fails the transport is shut down so the
+// client's own thread sees the disconnect and runs the normal leave path.
+void writeOutbox(std::shared_ptr<Outbox> box) {
+	std::vector<OutPiece> out;
+	std::vector<SendBuf> bufs;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(box->mx);
+			box->cv.wait(lock, [&] { return box->closed || box->hangUp || (!box->pending.empty() && box->corks == 0); });
+			if (box->pending.empty()) {
+				if (box->closed) return;
+				box->hangUp = false;
+				lock.unlock();
+				box->conn->shutdown();
+				continue;
+			}
+			std::swap(out, box->pending);
+		}
+		bufs.clear();
+		for (const auto& piece : out) {
+			const std::string& bytes = piece.shared ? *piece.shared : piece.bytes;
+			bufs.push_back({ bytes.data(), bytes.size() });
+		}
+		outboxSends.fetch_add(1, std::memory_order_relaxed);
+		if (!box->conn->sendAllv(bufs.data(), bufs.size())) {
+			{
+				std::lock_guard<std::mutex> lock(box->mx);
+				box->failed = true;
+				box->pending.clear();
+			}
+			box->conn->shutdown();
+			return;
+		}
+		for (auto& piece : out) {
+			if (!piece.shared) bufferPool.give(std::move(piece.bytes), box->node);
+		}
+		out.clear();
+	}
+}
+
+// Gives the inline pieces of the batch just sent back to the pool.
+void recyclePieces(Outbox& box) {
+	for (auto& piece : box.sending) {
+		if (!piece.shared) bufferPool.give(std::move(piece.bytes), box.node);
+	}
+	box.sending.clear();
+}
+
+// Marks an outbox failed and shuts the transport down, so the session notices and runs the normal leave path.
+void failOutbox(Outbox& box) {
+	{
+		std::lock_guard<std::mutex> lock(box.mx);
+		box.failed = true;
+		box.pending.clear();
+	}
+	recyclePieces(box);
+	box.conn->shutdown();
+}
+
+// Writes an outbox from the event loop, on the thread that owns its socket. Sends without blocking and, when the
+// socket buffer is full, waits for the socket to be writable again. Big batches go out as zero-copy sends and
+// the flush carries on once they complete. A client that takes nothing for sendStallMs is dropped.
+// Once the outbox is closed and drained the connection is closed.
+void flushOutbox(Outbox& box, bool timedOut) {
+	std::shared_ptr<Outbox> keep; // Released on the way out, after the last use of box
+	if (timedOut) failOutbox(box);
+	if (box.sendingAsync) {
+		box.sendingAsync = false;
+		if (box.asyncOk) recyclePieces(box);
+		else failOutbox(box);
+	}
+
+	while (true) {
+		if (box.sending.empty()) {
+			std::lock_guard<std::mutex> lock(box.mx);
+			if (box.failed || box.pending.empty() || box.corks > 0) {
+				bool drained = box.failed || box.pending.empty();
+				if (!(box.closed && drained)) { // Nothing to do until the next wakeWriter
+					box.scheduled = false;
+					keep = std::move(box.self);
+					if (drained && box.hangUp) {
+						box.hangUp = false;
+						box.conn->shutdown();
+					}
+					return;
+				}
+				keep = std::move(box.self); // scheduled stays set, nothing may post a closed outbox again
+				break;
+			}
+			std::swap(box.sending, box.pending);
+			box.sent = 0;
+		}
+
+		box.bufs.clear();
+		size_t skip = box.sent;
+		size_t total = 0;
+		for (const auto& piece : box.sending) {
+			const std::string& bytes = piece.shared ? *piece.shared : piece.bytes;
+			if (skip >= bytes.size()) {
+				skip -= bytes.size();
+				continue;
+			}
+			box.bufs.push_back({ bytes.data() + skip, bytes.size() - skip });
+			total += bytes.size() - skip;
+			skip = 0;
+		}
+
+		outboxSends.fetch_add(1, std::memory_order_relaxed);
+		if (total >= zeroCopyMin) {
+			Outbox* raw = &box; // Kept alive by box.self until the completion has been handled
+			bool started = box.conn->sendAsync(box.bufs.data(), box.bufs.size(), [raw](bool ok) {
+				raw->asyncOk = ok;
+				eventLoop.post(raw->socket, raw);
+			});
+			if (started) {
+				box.sendingAsync = true;
+				return;
+			}
+		}
+
+		long long n = box.conn->trySend(box.bufs.data(), box.bufs.size());
+		if (n < 0) {
+			failOutbox(box);
+			continue;
+		}
+		box.sent += (size_t)n;
+		if ((size_t)n == total) {
+			recyclePieces(box);
+			continue;
+		}
+		eventLoop.watch(box.socket, POLLWRNORM, sendStallMs, &box);
+		return;
+	}
+	if (!box.keepOpen) box.conn->close();
+	box.done = true;
+}
+
+void Outbox::ready(bool timedOut) {
+	flushOutbox(*this, timedOut);
+}
+
+// Creates the outbox of a new connection. Transports the event loop can't poll get a writer thread.
+void openOutbox(std::shared_ptr<Transport> conn) {
+	auto box = std::make_shared<Outbox>();
+	box->socket = conn->id();
+	box->conn = std::move(conn);
+	box->polled = box->conn->pollSocket() != INVALID_SOCKET;
+	if (box->polled) box->node = eventLoop.nodeFor(box->socket);
+	else box->writer = std::thread(writeOutbox, box);
+	std::lock_guard<std::mutex> lock(mx);
+	outboxes[box->socket] = box;
+}
+
+// Closes the outbox of a socket. The writer flushes what's left and the connection is closed after that,
+// unless keepOpen is set because the connection is being handed over.
+// Waits for the writer thread if there is one; the event loop finishes the job in the background.
+void closeOutbox(SOCKET s, bool keepOpen = false) {
+	std::shared_ptr<Outbox> box;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = outboxes.find(s);
+		if (it == outboxes.end()) return;
+		box = it->second;
+		outboxes.erase(it);
+	}
+	{
+		std::lock_guard<std::mutex> lock(box->mx);
+		box->closed = true;
+		box->keepOpen = keepOpen;
+	}
+	if (box->polled) {
+		wakeWriter(box);
+		return;
+	}
+	box->cv.notify_one();
+	if (box->writer.joinable()) box->writer.join();
+	if (!keepOpen) box->conn->close();
+	box->done = true;
+}
+
+// Shuts a session's connection down once what's already queued for it has been sent, so a line telling the
+// client why gets there first. The session sees its read fail and ends the usual way.
+void hangUpOutbox(SOCKET s) {
+	std::shared_ptr<Outbox> box;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = outboxes.find(s);
+		if (it == outboxes.end()) return;
+		box = it->second;
+	}
+	{
+		std::lock_guard<std::mutex> lock(box->mx);
+		box->hangUp = true;
+	}
+	wakeWriter(box);
+}
+
+// Add a newline (\n) character to the end of a line and queue it on the socket's outbox
 // Args are socket to send to, line that will be sent
 bool sendLine(SOCKET s, const std::string& line) {
-	std::string out = line;
+	std::shared_ptr<Outbox> box;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		auto it = outboxes.find(s);
+		if (it == outboxes.end()) return false;
+		box = it->second;
+	}
+	thread_local std::string out; // Reused by every call on this thread
+	out.assign(line);
 	if (out.empty() || out.back() != '\n') out.push_back('\n');
-	return sendAll(s, out.c_str(), (int)out.size());
+	if (out.size() >= zeroCopyMin) {
+		bool queued = enqueue(box, std::make_shared<const std::string>(std::move(out)));
+		out.clear();
+		return queued;
+	}
+	return enqueue(box, out);
+}
+
+// Queues a line on every outbox in the list. Large lists are split into chunks and spread over the fan-out pool.
+// Returns once the line is queued for every recipient, so lines from one sender reach each recipient in order,
+// except in a session on the event loop: there a large fan-out is left running on the pool and the session
+// waits for it before its next line instead (see FanoutWait). owner keeps the list alive for that, without it
+// the list is copied. A large line is built once and shared by every outbox instead of copied into each.
+void fanout(const OutboxList& recipients, const std::string& line, std::shared_ptr<const OutboxList> owner = nullptr) {
+	thread_local std::string out; // Reused by every call on this thread
+	out.assign(line);
+	if (out.empty() || out.back() != '\n') out.push_back('\n');
+
+	std::shared_ptr<FanoutWait> fanouts = currentBatch ? currentBatch->fanouts : nullptr;
+	if (fanouts && fanoutPool.workerCount() > 0 && (recipients.size() >= parallelFanoutMin || fanouts->busy())) {
+		if (!owner) owner = std::make_shared<const OutboxList>(recipients);
+		auto payload = std::make_shared<const std::string>(out);
+		fanouts->start([fanouts, owner, payload]() {
+			fanoutPool.submit(owner->size(), fanoutChunk, [owner, payload](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) enqueue((*owner)[i], payload);
+			}, [fanouts]() { fanouts->finished(); });
+		});
+		return;
+	}
+
+	auto deliver = [&](const auto& data) {
+		if (recipients.size() < parallelFanoutMin) {
+			for (const auto& box : recipients) enqueue(box, data);
+			return;
+		}
+		fanoutPool.run(recipients.size(), fanoutChunk, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) enqueue(recipients[i], data); // Pool threads have no batch, these go out right away
+		});
+	};
+	if (out.size() >= zeroCopyMin) {
+		deliver(std::make_shared<const std::string>(std::move(out)));
+		out.clear();
+	}
+	else deliver(out);
 }
 
 // Removes \r character
 // Takes the line as arg
-std::string stripCR(std::string& s) {
+std::string& stripCR(std::string& s) {
 	s.erase(std::remove(s.begin(), s.end(), '\r'), s.end());
 	return s;
 }
 
+// Removes a socket from a room's subscriber array by swapping it with the last entry.
+// Empty rooms are deleted. Must be called with mx held.
+void unsubscribe(const std::string& room, SOCKET s) {
+	auto it = rooms.find(room);
+	if (it == rooms.end()) return;
+	OutboxList& subs = it->second.subscribers;
+	auto pos = std::find_if(subs.begin(), subs.end(), [&](const std::shared_ptr<Outbox>& box) { return box->socket == s; });
+	if (pos != subs.end()) {
+		*pos = subs.back();
+		subs.pop_back();
+		it->second.snapshot.reset();
+	}
+	if (subs.empty()) rooms.erase(it);
+}
+
 // Remove client, takes in socket of the client as arg,
-// erases the client's information from every dictionary, closes the socket and returns username so 
+// erases the client's information from every dictionary, closes the connection and returns username so 
 // it can be broadcasted to the other users that this user left.
-std::string removeClient(SOCKET s) {
+// For a handoff, handOver gets the session's rooms and unread input, and the connection is left open.
+std::string removeClient(SOCKET s, HandedOver* handOver = nullptr) {
+	if (currentBatch) currentBatch->flush(); // Closing waits for the writer, which must not be held back by our own cork
 	std::string username;
 	{
 		std::lock_guard<std::mutex> lock(mx);
@@ -38,95 +377,276 @@ std::string removeClient(SOCKET s) {
 			clients.erase(username);
 			clientSockets.erase(it);
 		}
-		recvBuffers.erase(s);
+		auto bit = recvBuffers.find(s);
+		if (bit != recvBuffers.end()) {
+			if (handOver) handOver->unread.assign(bit->second.data, bit->second.head, std::string::npos);
+			recvBuffers.erase(bit);
+		}
+		auto rit = clientRooms.find(s);
+		if (rit != clientRooms.end()) {
+			for (const auto& room : rit->second) unsubscribe(room, s);
+			if (handOver) handOver->rooms = std::move(rit->second);
+			clientRooms.erase(rit);
+		}
 	}
-	closesocket(s);
+	closeOutbox(s, handOver != nullptr);
+	if (!username.empty() && !handOver) cluster.publishLeave(username);
 	return username;
 }
 
+// Adds the socket to a room, creating the room if it doesn't exist yet.
+// Returns false if the socket was already in the room.
+bool joinRoom(SOCKET s, const std::string& room) {
+	std::lock_guard<std::mutex> lock(mx);
+	auto box = outboxes.find(s);
+	if (box == outboxes.end()) return false;
+	std::vector<std::string>& joined = clientRooms[s];
+	if (std::find(joined.begin(), joined.end(), room) != joined.end()) return false;
+	joined.push_back(room);
+	Room& r = rooms[room];
+	r.subscribers.push_back(box->second);
+	r.snapshot.reset();
+	return true;
+}
+
+// Removes the socket from a room. Returns false if the socket wasn't in the room.
+bool partRoom(SOCKET s, const std::string& room) {
+	std::lock_guard<std::mutex> lock(mx);
+	auto rit = clientRooms.find(s);
+	if (rit == clientRooms.end()) return false;
+	std::vector<std::string>& joined = rit->second;
+	auto pos = std::find(joined.begin(), joined.end(), room);
+	if (pos == joined.end()) return false;
+	joined.erase(pos);
+	if (joined.empty()) clientRooms.erase(rit);
+	unsubscribe(room, s);
+	return true;
+}
+
+// Checks if the socket is subscribed to the room.
+bool inRoom(SOCKET s, const std::string& room) {
+	std::lock_guard<std::mutex> lock(mx);
+	auto rit = clientRooms.find(s);
+	if (rit == clientRooms.end()) return false;
+	return std::find(rit->second.begin(), rit->second.end(), room) != rit->second.end();
+}
+
+// Room names are 1-24 characters with no whitespace or control characters, like usernames.
+// Both end up as tab separated fields on the cluster bus, so a tab in one would split it into two.
+bool validRoomName(const std::string& room) {
+	if (room.empty() || room.size() > 24) return false;
+	for (unsigned char c : room) {
+		if (std::isspace(c) || std::iscntrl(c)) return false;
+	}
+	return true;
+}
+
+// Usernames follow the room name rules and can't have commas either, the USERS list is comma separated.
+bool validUsername(const std::string& username) {
+	return validRoomName(username) && username.find(',') == std::string::npos;
+}
+
+// Broadcast function for this node's own clients, takes the line to be broadcasted and the socket of the sender as an arg.
+// Collects the outbox of every client that isn't the sender and fans the line out to them.
+// Clients whose socket fails are cleaned up by their own thread, which broadcasts that they left.
+void broadcastLocal(const std::string& line, SOCKET sender = INVALID_SOCKET) {
+	thread_local OutboxList recipients; // Reused by every call on this thread
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		recipients.reserve(clients.size());
+		for (auto& c : clients) {
+			if (c.second == sender) continue;
+			auto it = outboxes.find(c.second);
+			if (it != outboxes.end()) recipients.push_back(it->second);
+		}
+	}
+	fanout(recipients, line);
+	recipients.clear(); // Keeps the capacity, drops the references
+}
+
 // Broadcast function, takes the line to be broadcasted and the socket of the sender as an arg.
-// Parses every socket that isn't the sender's socket and adds them to a list.
-// Calls sendLine to send the message to each socket that is not the sender's socket.
-// SendLine uses sendAll to send every byte.
+// Sends to every local client except the sender, and once to every other node in the cluster.
 // Used for "client has left" or "client has joined" type messages
 void broadcast(const std::string& line, SOCKET sender = INVALID_SOCKET) {
-	std::vector<SOCKET> sockets;
+	broadcastLocal(line, sender);
+	cluster.publishAll(line);
+}
+
+// Like broadcast but sends it to every user including the sender itself. Used to broadcast a message to the whole server
+// Only takes the line as arg as socket is not required.
+void broadcastAll(const std::string& line) {
+	broadcast(line);
+}
+
+// Sends a line to this node's subscribers of a room. Only the room's subscriber array is walked,
+// so the cost depends on the size of the room rather than the number of users on the server.
+void roomcastLocal(const std::string& room, const std::string& line) {
+	std::shared_ptr<const OutboxList> recipients;
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		sockets.reserve(clients.size());
-		for (auto& c : clients) {
-			if (c.second != sender) sockets.push_back(c.second);
-		}
+		auto it = rooms.find(room);
+		if (it == rooms.end()) return;
+		if (!it->second.snapshot)
+			it->second.snapshot = std::make_shared<const OutboxList>(it->second.subscribers);
+		recipients = it->second.snapshot;
 	}
+	fanout(*recipients, line, recipients);
+}
 
-	std::vector<std::string> leavers;
-	for (SOCKET s : sockets) {
-		if (!sendLine(s, line)) {
-			std::string u = removeClient(s);
-			if (!u.empty()) leavers.push_back(u);
-		}
+// Sends a line to every subscriber of a room, on this node and the other nodes of the cluster.
+void roomcast(const std::string& room, const std::string& line) {
+	roomcastLocal(room, line);
+	cluster.publishRoom(room, line);
+}
+
+// Broadcast list of users. Used to construct the users list in the GUI.
+// Lists the local clients plus the users on the other nodes, and sends it to the local clients.
+// Every node sends its own list when presence changes, so this never goes over the bus.
+void broadcastUsers() {
+	std::vector<std::string> users;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		users.reserve(clients.size());
+		for (auto& c : clients) users.push_back(c.first);
 	}
+	cluster.appendUsers(users);
 
-	if (leavers.empty()) return;
+	std::string list = "USERS ";
+	bool first = true;
+	for (const auto& u : users) {
+		if (!first) list += ",";
+		list += u;
+		first = false;
+	}
+	broadcastLocal(list);
+}
 
-	std::vector<SOCKET> remaining;
+// For receiving text from a client connection. Its then written into the receive buffer of that client.
+// Takes the client connection as an arg and returns what receive() returned, or 0 if the client went past
+// maxLineBytes without ending its line, which ends the session like a disconnect.
+int receiveText(Transport& conn) {
+	char buff[1024];
+	int received = conn.receive(buff, sizeof(buff));
+	if (received <= 0) return received;
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		remaining.reserve(clients.size());
-		for (auto& c : clients) remaining.push_back(c.second);
+		RecvBuffer& buf = recvBuffers[conn.id()];
+		if (buf.head > 0 && buf.head * 2 >= buf.data.size()) { // Cut off the lines already taken before adding more
+			buf.data.erase(0, buf.head);
+			buf.head = 0;
+		}
+		buf.data.append(buff, buff + received);
+		if (buf.data.size() - buf.head > maxLineBytes && buf.data.find('\n', buf.head) == std::string::npos) {
+			std::cout << "Dropping a client whose line went over " << maxLineBytes << " bytes" << std::endl;
+			return 0;
+		}
 	}
+	return received;
+}
+
+// Transports without a socket to poll block right here, with the time limit set on the transport itself.
+// Once the server is stopping reads fail straight away, see stopSession.
+bool ReadAwaiter::await_ready() {
+	if (stopping != Stopping::No) return true;
+	if (conn.pollSocket() != INVALID_SOCKET) return false;
+	if (timeoutMs > 0) conn.setReceiveTimeout(timeoutMs);
+	ok = receiveText(conn) > 0;
+	return true;
+}
+
+void ReadAwaiter::await_suspend(std::coroutine_handle<> h) {
+	handle = h;
+	batch = currentBatch;
+	currentBatch = nullptr; // Other sessions run on this thread until we're back
+	eventLoop.watch(conn.pollSocket(), POLLRDNORM, timeoutMs, this);
+}
 
-	for (const auto& u : leavers) {
-		for (SOCKET s : remaining) {
-			sendLine(s, u + " has left!");
+void ReadAwaiter::ready(bool timedOut) {
+	if (stopping != Stopping::No) ok = false; // Woken by EventLoop::cancelReads, anything unread stays in the socket
+	else if (!timedOut) {
+		int received = receiveText(conn);
+		if (received < 0 && WSAGetLastError() == WSAEWOULDBLOCK) { // Woken for nothing, wait again
+			eventLoop.watch(conn.pollSocket(), POLLRDNORM, timeoutMs, this);
+			return;
 		}
+		ok = received > 0;
 	}
+	currentBatch = batch;
+	handle.resume(); // The session may finish and free this awaiter, so nothing after this
 }
 
-// Like broadcast but sends it to every user including the sender itself. Used to broadcast a message to the whole server
-// Only takes the line as arg as socket is not required.
-void broadcastAll(const std::string& line) {
-	std::vector<SOCKET> sockets;
+// Runs begin now, or once the fan-outs the session started before it are done.
+void FanoutWait::start(std::function<void()> begin) {
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		for (auto& c : clients) {
-			sockets.push_back(c.second);
+		if (running) {
+			queued.push_back(std::move(begin));
+			return;
 		}
+		running = true;
 	}
-	for (const auto& s : sockets) {
-		sendLine(s, line);
-	}
+	begin();
 }
 
-// Broadcast list of users. Used to construct the users list in the GUI.
-// Parses clients map and broadcasts all the users.
-void broadcastUsers() {
-	std::string list = "USERS ";
+// Called on a pool thread when a fan-out is done. Starts the next one, or wakes the session if it's waiting.
+void FanoutWait::finished() {
+	std::function<void()> next;
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		bool first = true;
-		for (auto& c : clients) {
-			if (!first) list += ",";
-			list += c.first;
-			first = false;
+		if (!queued.empty()) {
+			next = std::move(queued.front());
+			queued.pop_front();
+		}
+		else {
+			running = false;
+			if (!waiting) return;
+			waiting = false;
 		}
 	}
-	broadcastAll(list);
+	if (next) next();
+	else eventLoop.post(socket, this);
 }
 
-// For receiving text from a client socket. Its then written into the receive buffer of that client.
-// Takes the client socket as an arg.
-bool readText(SOCKET s) {
-	char buff[1024];
-	int received = recv(s, buff, sizeof(buff), 0);
-	if (received <= 0) return false;
+bool FanoutWait::busy() {
+	std::lock_guard<std::mutex> lock(mx);
+	return running;
+}
+
+// Returns false to carry on right away if the last fan-out finished in the meantime.
+bool FanoutWait::await_suspend(std::coroutine_handle<> h) {
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		recvBuffers[s].append(buff, buff + received);
+		if (!running) return false;
+		waiting = true;
+		handle = h;
 	}
+	batch = currentBatch;
+	currentBatch = nullptr; // Other sessions run on this thread until we're back
 	return true;
 }
 
+void FanoutWait::ready(bool) {
+	currentBatch = batch;
+	handle.resume();
+}
+
+// Wraps a transport's receive in an awaiter, see ReadAwaiter.
+ReadAwaiter readText(Transport& conn, int timeoutMs = 0) {
+	return ReadAwaiter(conn, timeoutMs);
+}
+
+// Deadline for a new connection's first line, 0 if there's no limit.
+int64_t handshakeDeadline() {
+	return admission.handshakeTimeoutMs > 0 ? steadyMs() + admission.handshakeTimeoutMs : 0;
+}
+
+// Milliseconds left until a deadline from handshakeDeadline(): 0 if there's no limit, -1 once it has passed.
+int timeLeft(int64_t deadline) {
+	if (deadline == 0) return 0;
+	int64_t left = deadline - steadyMs();
+	return left > 0 ? (int)left : -1;
+}
+
 // Checks if a line inputted to a receive buffer is complete with a \n newline character at the end.
 // Takes the socket that the message is being received from and a reference to the output as arguments.
 bool completeLine(SOCKET s, std::string& output) {
@@ -134,97 +654,230 @@ bool completeLine(SOCKET s, std::string& output) {
 	auto it = recvBuffers.find(s);
 	if (it == recvBuffers.end()) return false;
 
-	std::string& buf = it->second;
-	size_t pos = buf.find('\n');
+	RecvBuffer& buf = it->second;
+	size_t pos = buf.data.find('\n', buf.head);
 	if (pos == std::string::npos) return false;
 
-	output = buf.substr(0, pos);
-	buf.erase(0, pos + 1);
+	output.assign(buf.data, buf.head, pos - buf.head); // Reuses the capacity output already has
+	buf.head = pos + 1;
+	if (buf.head == buf.data.size()) {
+		buf.data.clear();
+		buf.head = 0;
+	}
 	stripCR(output);
 	return true;
 }
 
-// Main server functionality. Takes the client socket as an argument after the threading.
+// Copies the next space-separated word of line, starting at pos, into word and moves pos past it.
+// Does what istringstream >> did without building a stream for every command.
+void nextWord(const std::string& line, size_t& pos, std::string& word) {
+	while (pos < line.size() && std::isspace((unsigned char)line[pos])) pos++;
+	size_t end = pos;
+	while (end < line.size() && !std::isspace((unsigned char)line[end])) end++;
+	word.assign(line, pos, end - pos);
+	pos = end;
+}
+
+// Gives buffers that grew past keepMax back to the pool, the rest keep their capacity for the next batch.
+void SessionArena::reset() {
+	for (std::string* s : { &line, &cmd, &target, &room, &message, &out }) {
+		if (s->capacity() <= keepMax) continue;
+		bufferPool.give(std::move(*s));
+		*s = std::string();
+	}
+}
+
+// Tells a client the server is going away and when to come back. The delay is picked at random within
+// reconnectSpreadMs, so the clients of a whole server don't all reconnect at the same moment.
+int reconnectDelay() {
+	thread_local std::mt19937 rng{ std::random_device{}() };
+	return reconnectSpreadMs > 0 ? std::uniform_int_distribution<int>(0, reconnectSpreadMs)(rng) : 0;
+}
+
+void sendReconnectHint(SOCKET s) {
+	sendLine(s, "Server is shutting down.");
+	sendLine(s, "RECONNECT " + std::to_string(reconnectDelay()));
+}
+
+// Ends a session whose read was cut short by the server stopping. On a handoff a socket session is parked:
+// taken off the server with its connection left open, for the new process to carry on once its outbox has
+// drained. Otherwise the client gets a reconnect hint and is closed after it.
+void stopSession(Transport& conn) {
+	SOCKET s = conn.id();
+	if (stopping == Stopping::Handoff && conn.pollSocket() != INVALID_SOCKET) {
+		std::shared_ptr<Outbox> box;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			auto it = outboxes.find(s);
+			if (it != outboxes.end()) box = it->second;
+		}
+		Parked p;
+		p.state.socket = s;
+		p.state.username = removeClient(s, &p.state);
+		p.box = std::move(box);
+		std::lock_guard<std::mutex> lock(mx);
+		parked.push_back(std::move(p));
+		return;
+	}
+	sendReconnectHint(s);
+	removeClient(s);
+}
+
+// Main server functionality. A coroutine: it reads like a blocking loop, but every co_await readText gives the
+// thread back to the event loop until the client sends more, so a handful of threads run every socket session.
+// Started by startSession with the client connection, any bytes already read from it and the connection's
+// admission slot, which is held until the session ends.
+// A session handed over from the old process on a restart comes with its username and rooms and skips the login.
+// The client gets admission.handshakeTimeoutMs to send its username.
 // Receives the username of the client as its first message.
 // Adds the client's username, socket, recvBuffer information to the relevant maps.
 // Listens for messages and sends messages based on commands (broadcast or unicast)
 // Uses the helpers (broadcast, completeline, readtext etc.)
-void clientAdd(SOCKET client_socket) {
+Detached clientAdd(std::shared_ptr<Transport> conn, std::string initial, std::unique_ptr<Admission::Slot> slot,
+	std::string username, std::vector<std::string> resumedRooms) {
+	SOCKET client_socket = conn->id();
 	{
 		std::lock_guard<std::mutex> lock(mx);
-		recvBuffers[client_socket] = "";
+		RecvBuffer& buf = recvBuffers[client_socket];
+		buf.data.insert(buf.head, initial); // In front of anything already read
 	}
+	openOutbox(conn);
 
-	std::string username;
+	bool resumed = !username.empty();
+	if (resumed) {
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			clients[username] = client_socket;
+			clientSockets[client_socket] = username;
+		}
+		for (const auto& room : resumedRooms) joinRoom(client_socket, room);
+	}
+
+	int64_t deadline = resumed ? 0 : handshakeDeadline(); // Don't let a connection that never says who it is hold a slot
 	while (username.empty()) {
 		std::string line;
 
 		while (!completeLine(client_socket, line)) {
-			if (!readText(client_socket)) {
-				removeClient(client_socket);
-				return;
+			int left = timeLeft(deadline);
+			if (left < 0 || !co_await readText(*conn, left)) {
+				if (stopping != Stopping::No) stopSession(*conn);
+				else removeClient(client_socket);
+				co_return;
 			}
 		}
 
 		username = line; // Receive username
 
-		if (username.empty() || username.size() > 24) {
-			sendLine(client_socket, "Invalid username (Should be 1-24 characters).");
-			{
-				std::lock_guard<std::mutex> lock(mx);
-				recvBuffers.erase(client_socket);
-			}
-			closesocket(client_socket);
-			return;
+		if (!validUsername(username)) {
+			sendLine(client_socket, "Invalid username (Should be 1-24 characters, no spaces or commas).");
+			removeClient(client_socket);
+			co_return;
 		}
 
+		bool taken;
 		{
 			std::lock_guard<std::mutex> lock(mx);
-			if (clients.find(username) != clients.end()) {
-				sendLine(client_socket, "Username already taken.");
-				recvBuffers.erase(client_socket);
-				closesocket(client_socket);
-				return;
+			taken = clients.find(username) != clients.end() || cluster.hasUser(username);
+			if (!taken) {
+				clients[username] = client_socket;
+				clientSockets[client_socket] = username;
 			}
-			clients[username] = client_socket;
-			clientSockets[client_socket] = username;
 		}
+		if (taken) {
+			sendLine(client_socket, "Username already taken.");
+			removeClient(client_socket);
+			co_return;
+		}
+
+	}
 
+	if (deadline != 0) conn->setReceiveTimeout(0);
+	FlushBatch batch;
+	if (conn->pollSocket() != INVALID_SOCKET) batch.fanouts = std::make_shared<FanoutWait>(client_socket);
+	if (!resumed) {
+		cluster.publishJoin(username);
+		sendLine(client_socket, "Welcome " + username + "!");
+		broadcastUsers();
+		broadcast(username + " has joined!", client_socket);
 	}
 
-	sendLine(client_socket, "Welcome " + username + "!");
-	broadcastUsers();
-	broadcast(username + " has joined!", client_socket);
+	SessionArena arena;
+	std::string& line = arena.line;
+	std::string& cmd = arena.cmd;
+	std::string& target = arena.target;
+	std::string& room = arena.room;
+	std::string& message = arena.message;
+	std::string& out = arena.out;
+
+	int64_t now = steadyMs(); // Read once per recv, every line of the recv is checked against it
+	TokenBucket broadcasts, dms, commands;
+	bool local = conn->local();
+	broadcasts.configure(local ? localBroadcastLimit : broadcastLimit, now);
+	dms.configure(local ? localDmLimit : dmLimit, now);
+	commands.configure(local ? localCommandLimit : commandLimit, now);
+	bool throttled = false;
+	auto logDropped = [&]() {
+		uint64_t dropped = broadcasts.dropped + dms.dropped + commands.dropped;
+		if (dropped > 0) std::cout << username << " went over the rate limit, " << dropped << " lines dropped" << std::endl;
+	};
 
 	while (true) {
-		std::string line;
+		if (batch.lines >= FlushBatch::flushEvery) { // Don't let a client that never pauses starve its recipients
+			batch.flush();
+			arena.reset();
+		}
+		if (batch.fanouts && batch.fanouts->busy()) { // Let the last line reach everyone before handling the next
+			batch.flush();
+			FanoutWait& fanouts = *batch.fanouts;
+			co_await fanouts;
+		}
 		while (!completeLine(client_socket, line)) {
-			if (!readText(client_socket)) { // Complete Line and Read text. Gracefully disconnect if they fail.
+			batch.flush(); // Out of lines, release the replies before waiting for more
+			arena.reset();
+			if (!co_await readText(*conn)) { // Complete Line and Read text. Gracefully disconnect if they fail.
+				logDropped();
+				if (stopping != Stopping::No) {
+					stopSession(*conn);
+					co_return;
+				}
 				std::string u = removeClient(client_socket);
 				if (!u.empty()) {
 					broadcastUsers();
 					broadcast(u + " has left!");
 				}
-				return;
+				co_return;
 			}
+			now = steadyMs();
 		}
+		batch.lines++;
 		if (line.empty()) continue;
 
 		if (line == "/leave") {
+			logDropped();
 			std::string u = removeClient(client_socket);
 			if (!u.empty()) {
 				broadcastUsers();
 				broadcast(u + " has left!");
 			}
-			return; // Remove client and broadcast that they've left
+			co_return; // Remove client and broadcast that they've left
 		}
 
+		TokenBucket* bucket = &broadcasts; // Charge the line to its budget before doing any work for it
+		if (line.rfind("/msg ", 0) == 0) bucket = &dms;
+		else if (line.rfind("/join ", 0) == 0 || line.rfind("/part ", 0) == 0) bucket = &commands;
+		if (!bucket->take(now)) {
+			rateLimitedLines.fetch_add(1, std::memory_order_relaxed);
+			if (!throttled) sendLine(client_socket, "Slow down, your messages are being dropped.");
+			throttled = true; // Tell them once per run of drops, not once per line
+			continue;
+		}
+		throttled = false;
+
 		if (line.rfind("/msg ", 0) == 0) {
-			std::istringstream iss(line);
-			std::string cmd, target;
-			iss >> cmd >> target;
-			std::string message;
-			std::getline(iss, message); // Extract message from the DM.
+			size_t pos = 0;
+			nextWord(line, pos, cmd);
+			nextWord(line, pos, target);
+			message.assign(line, pos, std::string::npos); // Extract message from the DM.
 			if (!message.empty() && message[0] == ' ')
 				message.erase(0, 1);
 			if (target.empty() || message.empty()) {
@@ -241,56 +894,568 @@ void clientAdd(SOCKET client_socket) {
 				auto it = clients.find(target);
 				if (it != clients.end()) receiver_socket = it->second;
 			}
-			if (receiver_socket == INVALID_SOCKET) {
+			if (receiver_socket != INVALID_SOCKET) {
+				out.assign("(DM) ").append(username).append(": ").append(message);
+				sendLine(receiver_socket, out);
+			}
+			else if (cluster.sendDM(username, target, message) == Cluster::DMResult::NoSuchUser) { // Not local, the cluster sends it to the user's node
 				sendLine(client_socket, "User not found: " + target);
 				continue;
 			}
-			sendLine(receiver_socket, "(DM) " + username + ": " + message);
-			sendLine(client_socket, "(DM to " + target + ") " + message);
+			out.assign("(DM to ").append(target).append(") ").append(message);
+			sendLine(client_socket, out);
 			continue; // DMing functionality
 		}
-		broadcastAll(username + ": " + line); // If not DM, simply broadcast message to all (including the user who sent it so they can see it on their screen)
+		if (line.rfind("/join ", 0) == 0 || line.rfind("/part ", 0) == 0) {
+			size_t pos = 0;
+			nextWord(line, pos, cmd);
+			nextWord(line, pos, room);
+			if (!validRoomName(room)) {
+				sendLine(client_socket, "Invalid room name (Should be 1-24 characters, no spaces).");
+				continue;
+			}
+			if (cmd == "/join") {
+				if (!joinRoom(client_socket, room)) {
+					sendLine(client_socket, "Already in room: " + room);
+					continue;
+				}
+				out.assign("[").append(room).append("] ").append(username).append(" has joined!");
+				roomcast(room, out);
+			}
+			else {
+				if (!partRoom(client_socket, room)) {
+					sendLine(client_socket, "Not in room: " + room);
+					continue;
+				}
+				sendLine(client_socket, "Left room: " + room);
+				out.assign("[").append(room).append("] ").append(username).append(" has left!");
+				roomcast(room, out);
+			}
+			continue; // Room membership
+		}
+
+		if (line.rfind("/room ", 0) == 0) {
+			size_t pos = 0;
+			nextWord(line, pos, cmd);
+			nextWord(line, pos, room);
+			message.assign(line, pos, std::string::npos);
+			if (!message.empty() && message[0] == ' ')
+				message.erase(0, 1);
+			if (room.empty() || message.empty()) {
+				sendLine(client_socket, "Format: /room <room> <message>");
+				continue;
+			}
+			if (!inRoom(client_socket, room)) {
+				sendLine(client_socket, "Not in room: " + room);
+				continue;
+			}
+			out.assign("[").append(room).append("] ").append(username).append(": ").append(message);
+			roomcast(room, out);
+			continue; // Room-scoped message, only sent to the room's subscribers
+		}
+
+		out.assign(username).append(": ").append(line);
+		broadcastAll(out); // If not DM, simply broadcast message to all (including the user who sent it so they can see it on their screen)
 	}
 }
 
-// Main function. Initialises WinSock. Creates a server socket. Binds the socket to an address and port (65432)
-// Listens for connections, starts a thread to ClientAdd on connection.
-int main() {
+// Joins the cluster bus. Bus threads call back in here to reach this node's own clients.
+bool startCluster(const std::string& node, unsigned short busPort, const std::vector<std::string>& peers) {
+	Cluster::Handlers h;
+	h.deliverAll = [](const std::string& line) { broadcastLocal(line); };
+	h.deliverRoom = [](const std::string& room, const std::string& line) { roomcastLocal(room, line); };
+	h.deliverDM = [](const std::string& from, const std::string& to, const std::string& message) {
+		SOCKET s = INVALID_SOCKET;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			auto it = clients.find(to);
+			if (it != clients.end()) s = it->second;
+		}
+		return s != INVALID_SOCKET && sendLine(s, "(DM) " + from + ": " + message);
+	};
+	h.deliverSystem = [](const std::string& to, const std::string& line) {
+		SOCKET s = INVALID_SOCKET;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			auto it = clients.find(to);
+			if (it != clients.end()) s = it->second;
+		}
+		if (s != INVALID_SOCKET) sendLine(s, line);
+	};
+	h.presenceChanged = [](const std::vector<std::string>& lost) {
+		broadcastUsers();
+		for (const auto& u : lost) broadcastLocal(u + " has left!");
+	};
+	h.localUsers = [] {
+		std::vector<std::string> users;
+		std::lock_guard<std::mutex> lock(mx);
+		for (auto& c : clients) users.push_back(c.first);
+		return users;
+	};
+	h.hasLocalUser = [](const std::string& user) {
+		std::lock_guard<std::mutex> lock(mx);
+		return clients.find(user) != clients.end();
+	};
+	h.evictLocal = [](const std::string& user) {
+		SOCKET s = INVALID_SOCKET;
+		{
+			std::lock_guard<std::mutex> lock(mx); // Off the roster now, so the session ends without a LEAVE of its own
+			auto it = clients.find(user);
+			if (it == clients.end()) return;
+			s = it->second;
+			clients.erase(it);
+			clientSockets.erase(s);
+		}
+		cluster.publishLeave(user); // For nodes that only heard of this session, the winner's entries stay
+		sendLine(s, "Username already taken.");
+		hangUpOutbox(s);
+	};
+	return cluster.start(node, busPort, peers, h);
+}
+
+// Creates a listening Unix domain socket at the given path. Any stale socket file from an earlier run is removed first.
+// With ownerOnly, only the account running the server can connect.
+SOCKET listenUnix(const std::string& path, bool ownerOnly) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Invalid Unix socket path: " << path << std::endl;
+		return INVALID_SOCKET;
+	}
+	std::copy(path.begin(), path.end(), address.sun_path);
+
+	SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) {
+		std::cerr << "Unix socket failed with error: " << WSAGetLastError() << std::endl;
+		return INVALID_SOCKET;
+	}
+	std::remove(path.c_str());
+	if (bind(s, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+		std::cerr << "Unix socket bind to " << path << " failed with error: " << WSAGetLastError() << std::endl;
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	if (ownerOnly && !restrictToOwner(path)) {
+		std::cerr << "Could not restrict " << path << " to this account: " << GetLastError() << std::endl;
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	if (listen(s, SOMAXCONN) == SOCKET_ERROR) {
+		std::cerr << "Unix socket listen on " << path << " failed with error: " << WSAGetLastError() << std::endl;
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+// Lane of a line going to a UDP client (see UdpSession). Each room and each DM conversation gets its own, so a lost
+// packet only holds up that conversation. Everything else (user lists, replies, server-wide messages) shares lane 0.
+// Names can't hold spaces, so the first space (or ": " after a sender) ends the name.
+uint8_t conversationLane(const char* data, size_t len) {
+	std::string_view line(data, len);
+	line = line.substr(0, line.find('\n'));
+	std::string_view name;
+	if (line.rfind("[", 0) == 0) { // [room] ...
+		size_t end = line.find("] ");
+		if (end != std::string_view::npos) name = line.substr(1, end - 1);
+	}
+	else if (line.rfind("(DM to ", 0) == 0) { // (DM to user) ...
+		size_t end = line.find(") ", 7);
+		if (end != std::string_view::npos) name = line.substr(7, end - 7);
+	}
+	else if (line.rfind("(DM) ", 0) == 0) { // (DM) user: ...
+		size_t end = line.find(": ", 5);
+		if (end != std::string_view::npos) name = line.substr(5, end - 5);
+	}
+	if (name.empty() || name.find(' ') != std::string_view::npos) return 0;
+	return (uint8_t)(1 + std::hash<std::string_view>()(name) % (UdpSession::laneCount - 1));
+}
+
+// Starts the session of a new connection: on the event loop if the transport can be polled, else on a thread of its own.
+// username and rooms are only set for a session taken over from the old process on a restart.
+void startSession(std::shared_ptr<Transport> conn, std::string initial, std::unique_ptr<Admission::Slot> slot,
+	std::string username = std::string(), std::vector<std::string> rooms = std::vector<std::string>()) {
+	if (conn->pollSocket() != INVALID_SOCKET) clientAdd(std::move(conn), std::move(initial), std::move(slot), std::move(username), std::move(rooms));
+	else std::thread(clientAdd, std::move(conn), std::move(initial), std::move(slot), std::move(username), std::move(rooms)).detach();
+}
+
+// Session on the Unix domain socket. A first line of "/shm <name>" attaches a bot's shared-memory rings
+// (see ShmTransport) and the session runs over those, with the socket kept only to notice the bot going away.
+// Anything else is a normal client and the line read is handed on to clientAdd with the rest of the buffer.
+Detached unixSession(SOCKET s, std::unique_ptr<Admission::Slot> slot) {
+	auto conn = std::make_shared<SocketTransport>(s);
+	std::string first;
+	int64_t deadline = handshakeDeadline();
+	while (!completeLine(s, first)) {
+		int left = timeLeft(deadline);
+		if (left < 0 || !co_await readText(*conn, left)) {
+			{
+				std::lock_guard<std::mutex> lock(mx);
+				recvBuffers.erase(s);
+			}
+			conn->close();
+			co_return;
+		}
+	}
+
+	if (first.rfind("/shm ", 0) == 0) {
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			recvBuffers.erase(s);
+		}
+		std::string name = first.substr(5);
+		auto shm = ShmTransport::open(name, s);
+		if (!shm) {
+			std::string reply = "Could not attach shared memory: " + name + "\n";
+			conn->sendAll(reply.c_str(), (int)reply.size());
+			conn->close();
+			co_return;
+		}
+		startSession(shm, "", std::move(slot));
+		co_return;
+	}
+	startSession(conn, first + "\n", std::move(slot));
+}
+
+// Turns away a connection the server has no room for.
+void refuse(SOCKET s) {
+	const char reply[] = "Server is busy, try again later.\n";
+	send(s, reply, sizeof(reply) - 1, 0);
+	closesocket(s);
+}
+
+// Waits for a connection to accept on a listening socket. Gives up every so often, so the accept loops notice a stop.
+bool waitForConnection(SOCKET listener) {
+	WSAPOLLFD fd = {};
+	fd.fd = listener;
+	fd.events = POLLRDNORM;
+	return WSAPoll(&fd, 1, 200) > 0;
+}
+
+// Accept loop for the Unix domain socket. Bots and bridges on the same machine connect here to skip the
+// TCP loopback stack. They speak the same protocol and get the same clientAdd session as TCP clients,
+// on the event loop as well.
+void acceptUnix(SOCKET listener) {
+	while (stopping == Stopping::No) {
+		if (!admission.waitForRoom()) break;
+		if (!waitForConnection(listener)) continue;
+		SOCKET client_socket = accept(listener, nullptr, nullptr);
+		if (client_socket == INVALID_SOCKET) {
+			std::cerr << "Unix accept failed: " << WSAGetLastError() << std::endl;
+			continue;
+		}
+		auto slot = admission.admit(""); // Local clients only count towards the total
+		if (!slot) {
+			refuse(client_socket);
+			continue;
+		}
+		unixSession(client_socket, std::move(slot));
+	}
+	closesocket(listener);
+}
+
+// Stops taking connections and starts the drain or handoff. The accept loops notice and end, and the main
+// thread finishes the job in finishStop. Only the first call does anything.
+void requestStop(Stopping mode) {
+	Stopping running = Stopping::No;
+	if (!stopping.compare_exchange_strong(running, mode)) return;
+	std::cout << (mode == Stopping::Handoff ? "Handing over to the new process..." : "Draining...") << std::endl;
+	admission.stop(); // An accept loop waiting for room at the connection limit would never get to finishStop
+	eventLoop.cancelReads();
+}
+
+// Ctrl+C, Ctrl+Break or the console closing drain the server instead of killing it.
+BOOL WINAPI onConsoleEvent(DWORD event) {
+	requestStop(Stopping::Drain);
+	if (event == CTRL_C_EVENT || event == CTRL_BREAK_EVENT) return TRUE;
+	Sleep(drainTimeoutMs + 1000); // Windows ends the process once this returns, give the main thread time to finish
+	return TRUE;
+}
+
+// Waits on the handoff socket for a new process to take over from this one (see --take-over), then hands over.
+void acceptSuccessor(SOCKET listener) {
+	while (true) {
+		SOCKET channel = accept(listener, nullptr, nullptr);
+		if (channel == INVALID_SOCKET) {
+			std::cerr << "Handoff accept failed: " << WSAGetLastError() << std::endl;
+			continue;
+		}
+		DWORD pid = 0;
+		if (!receiveSuccessor(channel, pid)) {
+			closesocket(channel);
+			continue;
+		}
+		handoffChannel = channel;
+		successorPid = pid;
+		closesocket(listener);
+		requestStop(Stopping::Handoff);
+		return;
+	}
+}
+
+// Runs on the main thread once the accept loop has ended. Every session was woken by requestStop and is
+// parking or closing itself; the ones that can't be woken (UDP and shared memory sessions block in their
+// own threads) are hinted and closed from here. Waits up to drainTimeoutMs for the outboxes to drain,
+// then passes the parked sessions and the listening socket to the new process on a handoff.
+void finishStop() {
+	OutboxList boxes;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		for (const auto& o : outboxes) boxes.push_back(o.second);
+	}
+	for (const auto& box : boxes) {
+		if (box->polled) continue;
+		sendReconnectHint(box->socket);
+		closeOutbox(box->socket);
+	}
+
+	int64_t deadline = steadyMs() + drainTimeoutMs;
+	for (const auto& box : boxes) {
+		while (!box->done && steadyMs() < deadline) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if (stopping != Stopping::Handoff) return;
+
+	std::vector<Parked> leaving;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		leaving.swap(parked);
+	}
+	std::vector<HandedOver> sessions;
+	for (auto& p : leaving) {
+		if (p.box && p.box->done && !p.box->failed) sessions.push_back(p.state); // Anything else may have lost bytes on the way
+	}
+	if (sendHandoff(handoffChannel, successorPid, listenSocket, sessions, drainTimeoutMs)) {
+		std::cout << "Handed " << sessions.size() << " sessions over" << std::endl;
+		return;
+	}
+	std::cerr << "Handoff failed, closing the sessions" << std::endl;
+	for (auto& p : leaving) {
+		std::string hint = "RECONNECT " + std::to_string(reconnectDelay()) + "\n";
+		send(p.state.socket, hint.c_str(), (int)hint.size(), 0);
+		closesocket(p.state.socket);
+	}
+}
+
+// Main function. Initialises WinSock. Creates a server socket. Binds the socket to an address and port (65432 by default)
+// Starts the event loop, listens for connections and starts a clientAdd session on it for each one.
+// Optional args, to run several nodes as one cluster:
+//   --port <port>        port clients connect to
+//   --node <name>        name of this node, defaults to node-<bus port>
+//   --bus-port <port>    port other nodes connect to, turns clustering on
+//   --peer <host:port>   bus address of another node, repeat for every other node
+// and to also accept clients on a Unix domain socket or over reliable UDP:
+//   --unix <path>        socket file to listen on
+//   --udp <port>         UDP port to listen on
+//   --udp-loss <pct>     drop this percentage of outgoing UDP packets, for testing on loopback
+//   --udp-delay <ms>     delay outgoing UDP packets, for testing on loopback
+//   --udp-jitter <ms>    add up to this much random extra delay
+// Limits:
+//   --rate-broadcast, --rate-dm, --rate-command <lines/s>   per-session budgets, 0 for no limit
+//   --rate-local-broadcast, --rate-local-dm, --rate-local-command <lines/s>
+//                                budgets of Unix socket and shared-memory sessions instead, no limit by default
+//   --max-conns <n>              connections the server takes before it stops accepting
+//   --max-per-ip <n>             connections allowed from one address
+//   --handshake-timeout <ms>     time a new connection gets to send its username, 0 for no limit
+// Threads:
+//   --io-threads <n>     event loop threads the socket sessions run on, defaults to the core count up to 4
+// Low latency mode, all off by default:
+//   --pin-cores <list>   comma separated cores, event loop thread i runs only on the i-th (wrapping round).
+//                        Cores are numbered across every processor group, the server won't start on one it doesn't have
+//   --numa               give the pinned threads of each NUMA node their own outbox buffer free lists
+//   --busy-poll <us>     event loop threads poll this long before sleeping, each keeps its core busy while idle
+// Stopping and restarting. Ctrl+C drains the server: it stops accepting, flushes every client's outbox and tells
+// each client when to reconnect (a random point within the spread) before exiting.
+//   --drain-timeout <ms>      time the clients get to take what they're owed, 5000 by default
+//   --reconnect-spread <ms>   window the reconnect hints are spread over, 5000 by default
+//   --handoff <path>          Unix socket a new process can take this one over through
+//   --take-over <path>        start by taking over the sockets of the server listening on path with --handoff
+int main(int argc, char* argv[]) {
 	WSADATA wsaData;
-	int iResult;
+	unsigned short port = 65432;
+	std::string unixPath;
+	unsigned short udpPort = 0;
+	UdpEndpoint::Impairment impairment;
+	unsigned short busPort = 0;
+	std::string node;
+	std::vector<std::string> peers;
+	unsigned int ioThreads = 0;
+	std::string handoffPath;
+	std::string takeOverPath;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--port" && hasValue) port = (unsigned short)std::stoi(argv[++i]);
+		else if (arg == "--bus-port" && hasValue) busPort = (unsigned short)std::stoi(argv[++i]);
+		else if (arg == "--node" && hasValue) node = argv[++i];
+		else if (arg == "--peer" && hasValue) peers.push_back(argv[++i]);
+		else if (arg == "--unix" && hasValue) unixPath = argv[++i];
+		else if (arg == "--udp" && hasValue) udpPort = (unsigned short)std::stoi(argv[++i]);
+		else if (arg == "--udp-loss" && hasValue) impairment.loss = std::stod(argv[++i]) / 100;
+		else if (arg == "--udp-delay" && hasValue) impairment.delayMs = std::stoi(argv[++i]);
+		else if (arg == "--udp-jitter" && hasValue) impairment.jitterMs = std::stoi(argv[++i]);
+		else if (arg == "--rate-broadcast" && hasValue) broadcastLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--rate-dm" && hasValue) dmLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--rate-command" && hasValue) commandLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--rate-local-broadcast" && hasValue) localBroadcastLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--rate-local-dm" && hasValue) localDmLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--rate-local-command" && hasValue) localCommandLimit.perSecond = std::stoi(argv[++i]);
+		else if (arg == "--max-conns" && hasValue) admission.maxConnections = std::stoul(argv[++i]);
+		else if (arg == "--max-per-ip" && hasValue) admission.maxPerAddress = std::stoul(argv[++i]);
+		else if (arg == "--handshake-timeout" && hasValue) admission.handshakeTimeoutMs = std::stoi(argv[++i]);
+		else if (arg == "--io-threads" && hasValue) ioThreads = (unsigned int)std::stoul(argv[++i]);
+		else if (arg == "--pin-cores" && hasValue) {
+			std::stringstream list(argv[++i]);
+			std::string core;
+			while (std::getline(list, core, ',')) eventLoop.pinCores.push_back((unsigned int)std::stoul(core));
+		}
+		else if (arg == "--numa") eventLoop.numa = true;
+		else if (arg == "--busy-poll" && hasValue) eventLoop.busyPollUs = std::stoi(argv[++i]);
+		else if (arg == "--drain-timeout" && hasValue) drainTimeoutMs = std::stoi(argv[++i]);
+		else if (arg == "--reconnect-spread" && hasValue) reconnectSpreadMs = std::stoi(argv[++i]);
+		else if (arg == "--handoff" && hasValue) handoffPath = argv[++i];
+		else if (arg == "--take-over" && hasValue) takeOverPath = argv[++i];
+		else {
+			std::cerr << "Usage: GENetworks [--port <port>] [--unix <path>] [--udp <port> [--udp-loss <pct>] [--udp-delay <ms>] [--udp-jitter <ms>]]"
+				<< " [--node <name>] [--bus-port <port>] [--peer <host:port>]..."
+				<< " [--rate-broadcast <lines/s>] [--rate-dm <lines/s>] [--rate-command <lines/s>]"
+				<< " [--rate-local-broadcast <lines/s>] [--rate-local-dm <lines/s>] [--rate-local-command <lines/s>]"
+				<< " [--max-conns <n>] [--max-per-ip <n>] [--handshake-timeout <ms>] [--io-threads <n>]"
+				<< " [--pin-cores <list>] [--numa] [--busy-poll <us>]"
+				<< " [--drain-timeout <ms>] [--reconnect-spread <ms>] [--handoff <path>] [--take-over <path>]" << std::endl;
+			return 1;
+		}
+	}
 
 	if (WSAStartup(MAKEWORD(2, 2), &wsaData)!= 0) {
 		std::cerr << "WSAStartup failed: \n" << WSAGetLastError() << std::endl;
 		return 1;
 	}
 
-	SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (server_socket == INVALID_SOCKET) {
-		std::cerr << "Error at socket(): \n" << WSAGetLastError() << std::endl;
-		WSACleanup();
-		return 1;
+	SOCKET server_socket = INVALID_SOCKET;
+	SOCKET takeOverChannel = INVALID_SOCKET;
+	std::vector<HandedOver> takenOver;
+	if (!takeOverPath.empty()) { // The old process's listening socket, already bound and listening
+		takeOverChannel = receiveHandoff(takeOverPath, server_socket, takenOver);
+		if (takeOverChannel == INVALID_SOCKET) {
+			WSACleanup();
+			return 1;
+		}
 	}
+	else {
+		server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (server_socket == INVALID_SOCKET) {
+			std::cerr << "Error at socket(): \n" << WSAGetLastError() << std::endl;
+			WSACleanup();
+			return 1;
+		}
 
-	sockaddr_in server_address = {};
-	server_address.sin_family = AF_INET;
-	server_address.sin_port = htons(65432);
-	server_address.sin_addr.s_addr = INADDR_ANY;
+		sockaddr_in server_address = {};
+		server_address.sin_family = AF_INET;
+		server_address.sin_port = htons(port);
+		server_address.sin_addr.s_addr = INADDR_ANY;
 
-	if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
-		std::cerr << "Bind failed with error: " << WSAGetLastError() << std::endl;
-		closesocket(server_socket);
-		WSACleanup();
-		return 1;
+		if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) == SOCKET_ERROR) {
+			std::cerr << "Bind failed with error: " << WSAGetLastError() << std::endl;
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
+
+		if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
+			std::cerr << "Listen failed with error: " << WSAGetLastError() << std::endl;
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
 	}
+	listenSocket = server_socket;
 
-	if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
-		std::cerr << "Listen failed with error: " << WSAGetLastError() << std::endl;
+	unsigned int cores = std::thread::hardware_concurrency();
+	if (ioThreads == 0) ioThreads = std::min(std::max(cores, 1u), 4u);
+	ULONG highestNode = 0;
+	if (eventLoop.numa && GetNumaHighestNodeNumber(&highestNode) && highestNode > 0) bufferPool.setNodes(highestNode + 1);
+	if (!eventLoop.start(ioThreads)) {
 		closesocket(server_socket);
 		WSACleanup();
 		return 1;
 	}
 
-	while (1) {
+	if (takeOverChannel != INVALID_SOCKET) {
+		for (auto& session : takenOver) {
+			sockaddr_in peer = {};
+			int peerLen = sizeof(peer);
+			char address[INET_ADDRSTRLEN] = {};
+			if (getpeername(session.socket, (sockaddr*)&peer, &peerLen) == 0 && peer.sin_family == AF_INET)
+				inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address));
+			auto slot = admission.admit(address);
+			if (!slot) { // Only if this process was started with lower limits than the old one
+				refuse(session.socket);
+				continue;
+			}
+			startSession(std::make_shared<SocketTransport>(session.socket), std::move(session.unread), std::move(slot),
+				std::move(session.username), std::move(session.rooms));
+		}
+		std::cout << "Took over " << takenOver.size() << " sessions" << std::endl;
+		confirmHandoff(takeOverChannel); // Returns once the old process is gone and its ports are free
+	}
+
+	if (!unixPath.empty()) {
+		SOCKET unix_socket = listenUnix(unixPath, false);
+		if (unix_socket == INVALID_SOCKET) {
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
+		std::thread(acceptUnix, unix_socket).detach();
+	}
+
+	if (udpPort != 0) {
+		udpEndpoint.setImpairment(impairment);
+		udpEndpoint.setLanes(conversationLane);
+		bool listening = udpEndpoint.listen(udpPort, [](std::shared_ptr<UdpSession> session) {
+			char address[INET_ADDRSTRLEN] = {};
+			inet_ntop(AF_INET, &session->peer().sin_addr, address, sizeof(address));
+			auto slot = stopping == Stopping::No ? admission.admit(address) : nullptr;
+			if (!slot) {
+				session->close();
+				return;
+			}
+			startSession(session, std::string(), std::move(slot));
+		});
+		if (!listening) {
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
+	}
+
+	fanoutPool.start(cores > 1 ? cores - 1 : 0); // The thread doing the fan-out works too
+
+	if (busPort != 0) {
+		if (node.empty()) node = "node-" + std::to_string(busPort);
+		if (!startCluster(node, busPort, peers)) {
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
+		std::cout << "Node " << node << " serving clients on " << port << ", bus on " << busPort << std::endl;
+	}
+
+	if (!handoffPath.empty()) {
+		SOCKET handoff_socket = listenUnix(handoffPath, true); // Only this account may take over
+		if (handoff_socket == INVALID_SOCKET) {
+			closesocket(server_socket);
+			WSACleanup();
+			return 1;
+		}
+		std::thread(acceptSuccessor, handoff_socket).detach();
+	}
+	SetConsoleCtrlHandler(onConsoleEvent, TRUE);
+
+	while (stopping == Stopping::No) {
+		if (!admission.waitForRoom()) break; // At the limit, new connections queue in the listen backlog
+		if (!waitForConnection(server_socket)) continue;
 		sockaddr_in client_address = {};
 		int client_address_len = sizeof(client_address);
 		SOCKET client_socket = accept(server_socket, (sockaddr*)&client_address, &client_address_len);
@@ -298,10 +1463,20 @@ int main() {
 			std::cerr << "accept failed: " << WSAGetLastError() << std::endl;
 			continue;
 		}
-		std::thread t(clientAdd, client_socket);
-		t.detach();
+		char address[INET_ADDRSTRLEN] = {};
+		inet_ntop(AF_INET, &client_address.sin_addr, address, sizeof(address));
+		auto slot = admission.admit(address);
+		if (!slot) {
+			refuse(client_socket);
+			continue;
+		}
+		BOOL noDelay = TRUE;
+		setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+		startSession(std::make_shared<SocketTransport>(client_socket), std::string(), std::move(slot));
 	}
-	closesocket(server_socket);
+	if (stopping == Stopping::Drain) closesocket(server_socket); // Turn new connections away while the drain runs
+	finishStop();
+	if (stopping == Stopping::Handoff) closesocket(server_socket);
 	WSACleanup();
 	return 0;
 }
\ No newline at end of file
@@ -1,17 +1,229 @@
 #pragma once
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include <iostream>
 #include <thread>
 #include <unordered_map>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <cstdio>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <random>
+
+#include "admission.h"
+#include "cluster.h"
+#include "fanout.h"
+#include "handoff.h"
+#include "loop.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "shm.h"
+#include "transport.h"
+#include "udp.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 
+// Bytes received from a client that don't make a complete line yet. Lines are read from head onwards,
+// and the consumed front is only cut off once it makes up most of the buffer, so taking a line never
+// moves the rest of the data or frees the buffer.
+struct RecvBuffer {
+	std::string data;
+	size_t head = 0;
+};
+
 std::unordered_map<std::string, SOCKET> clients;
 std::unordered_map<SOCKET, std::string> clientSockets;
-std::unordered_map<SOCKET, std::string> recvBuffers;
+std::unordered_map<SOCKET, RecvBuffer> recvBuffers;
 std::mutex mx;
+
+BufferPool bufferPool; // Outbox pieces and oversized scratch buffers go back here to be reused
+
+// A run of outgoing bytes. Small writes are copied into the last inline piece, payloads of
+// zeroCopyMin or more are referenced so every recipient of a big broadcast shares one buffer.
+struct OutPiece {
+	std::string bytes;
+	std::shared_ptr<const std::string> shared;
+};
+
+// A client that takes no data for this long while we have some for it is dropped.
+const int sendStallMs = 30000;
+
+// Outgoing data for one client. Any thread can append lines, and the client's writer sends them,
+// so fanning a message out never blocks on a slow receiver. Pollable transports are written from the
+// event loop (see flushOutbox); the others get a writer thread (see writeOutbox).
+struct Outbox : Waiter {
+	SOCKET socket = INVALID_SOCKET; // Session key, the id of conn
+	std::shared_ptr<Transport> conn;
+	std::mutex mx;
+	std::condition_variable cv;
+	std::vector<OutPiece> pending;
+	bool closed = false;
+	bool failed = false;
+	bool keepOpen = false; // Closed for a handoff, the connection lives on in the new process
+	bool hangUp = false; // Shut the connection down once everything queued has gone, see hangUpOutbox
+	std::atomic<bool> done{ false }; // Closed and drained, or failed
+	int corks = 0; // Open FlushBatches holding this outbox back
+	uint64_t corkTag = 0; // Tag of the last batch that corked it
+	unsigned int node = 0; // NUMA node of the thread that sends it, its buffers go back to that node's free lists
+	std::thread writer;
+
+	// Writing from the event loop. scheduled is guarded by mx, the rest is only touched by the loop thread.
+	bool polled = false;
+	bool scheduled = false; // A flush is queued, running or waiting on the socket
+	std::shared_ptr<Outbox> self; // Keeps the outbox alive while the loop holds a pointer to it
+	std::vector<OutPiece> sending;
+	std::vector<SendBuf> bufs;
+	size_t sent = 0; // Bytes of sending already gone
+	bool sendingAsync = false;
+	bool asyncOk = false;
+
+	void ready(bool timedOut) override;
+};
+using OutboxList = std::vector<std::shared_ptr<Outbox>>;
+
+// Lines a session queues while it works through what one recv gave it. Every outbox the batch
+// touches stays corked until the session runs out of complete lines (or after flushEvery lines),
+// then each is released with one wakeup so a burst leaves in one send instead of one per line.
+// Windows has no TCP_CORK, so this does the same in the outbox. Sockets also get TCP_NODELAY,
+// since the batch already decides when a send happens and Nagle would only add delay on top.
+class FanoutWait;
+
+struct FlushBatch {
+	static const int flushEvery = 64;
+
+	FlushBatch();
+	~FlushBatch();
+	void flush();
+
+	uint64_t tag;
+	int lines = 0;
+	OutboxList corked;
+	std::shared_ptr<FanoutWait> fanouts; // Set for sessions on the event loop, see FanoutWait
+};
+thread_local FlushBatch* currentBatch = nullptr; // Batch of the session running on this thread, if any
+std::atomic<uint64_t> nextBatchTag{ 1 };
+
+// Scratch strings of one session: the line being handled, the words parsed out of it and the line built
+// in reply. They keep their capacity from line to line, so the steady-state message path doesn't allocate.
+// reset() runs after every batch and hands any buffer a huge line left behind back to the pool.
+struct SessionArena {
+	static const size_t keepMax = 4096;
+
+	std::string line, cmd, target, room, message, out;
+
+	void reset();
+};
+
+// co_await readText(conn, timeoutMs) reads what the client sent into its receive buffer, and gives false once the
+// connection is closed or failed, or nothing came within timeoutMs (0 for no limit). On a pollable transport the
+// session is suspended until the socket is readable, leaving the thread free for other sessions. Other transports
+// block in receive() on the session's own thread. The session's FlushBatch is carried across the suspension.
+class ReadAwaiter : public Waiter {
+public:
+	ReadAwaiter(Transport& conn, int timeoutMs) : conn(conn), timeoutMs(timeoutMs) {}
+
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	bool await_resume() const { return ok; }
+	void ready(bool timedOut) override;
+
+private:
+	Transport& conn;
+	int timeoutMs;
+	bool ok = false;
+	FlushBatch* batch = nullptr;
+	std::coroutine_handle<> handle;
+};
+
+// Large fan-outs of a session on the event loop are handed to the fan-out pool instead of holding up
+// the reactor thread, which has other sessions to run. They still go out one after another, in the
+// order the session started them, and co_await waits for all of them before the session reads on,
+// so lines from one sender keep reaching each recipient in order. The pool finishes them on its own
+// threads, so this is shared with the jobs and outlives the session if it has to.
+class FanoutWait : public Waiter {
+public:
+	explicit FanoutWait(SOCKET socket) : socket(socket) {}
+
+	void start(std::function<void()> begin); // begin submits the fan-out and calls finished() once it's done
+	void finished();
+	bool busy();
+
+	bool await_ready() { return !busy(); }
+	bool await_suspend(std::coroutine_handle<> h);
+	void await_resume() const {}
+	void ready(bool timedOut) override;
+
+private:
+	SOCKET socket;
+	std::mutex mx;
+	bool running = false;
+	bool waiting = false;
+	std::deque<std::function<void()>> queued;
+	FlushBatch* batch = nullptr;
+	std::coroutine_handle<> handle;
+};
+
+std::unordered_map<SOCKET, std::shared_ptr<Outbox>> outboxes;
+
+// A chat room. Subscribers are kept in a flat array so fan-out only walks the members of the room.
+// Fan-out copies the snapshot pointer instead of the array; the snapshot is rebuilt after the membership changes.
+struct Room {
+	OutboxList subscribers;
+	std::shared_ptr<const OutboxList> snapshot;
+};
+
+std::unordered_map<std::string, Room> rooms; // Room name -> room
+std::unordered_map<SOCKET, std::vector<std::string>> clientRooms; // Socket -> names of the rooms it has joined
+
+// Fan-out of a single message is split across the pool once the recipient list gets this large.
+const size_t parallelFanoutMin = 4096;
+const size_t fanoutChunk = 1024;
+FanoutPool fanoutPool;
+
+// Budgets every session gets, checked as soon as a line is complete. /room lines count as broadcasts,
+// /join and /part as commands. Lines over budget are dropped and counted.
+RateLimit broadcastLimit{ 20 };
+RateLimit dmLimit{ 20 };
+RateLimit commandLimit{ 10 };
+// Budgets of local sessions instead (see Transport::local). Bots go there to push tens of thousands of
+// lines a second, so there's no limit unless one is set.
+RateLimit localBroadcastLimit;
+RateLimit localDmLimit;
+RateLimit localCommandLimit;
+std::atomic<uint64_t> rateLimitedLines{ 0 }; // Dropped by every session together
+std::atomic<uint64_t> outboxSends{ 0 }; // Send calls made by every outbox together, for the benchmarks
+
+EventLoop eventLoop; // Runs the sessions of socket clients, see clientAdd
+Admission admission; // Limits on connections, set from the command line
+
+// Why the server is stopping. A drain sends every client a reconnect hint and closes it once its outbox
+// is flushed. A handoff passes the socket sessions to a new process instead (see handoff.h); sessions it
+// can't pass on are drained. Sessions whose read gets cut short look here to tell a stop from a disconnect.
+enum class Stopping { No, Drain, Handoff };
+std::atomic<Stopping> stopping{ Stopping::No };
+int drainTimeoutMs = 5000; // Time the sessions get to flush before the server exits anyway
+int reconnectSpreadMs = 5000; // Clients are told to reconnect at a random point within this
+SOCKET listenSocket = INVALID_SOCKET;
+SOCKET handoffChannel = INVALID_SOCKET; // Connection from the process taking over
+DWORD successorPid = 0;
+
+// A session stopped for a handoff, with its outbox so the handoff can wait for it to drain. Guarded by mx.
+struct Parked {
+	HandedOver state;
+	std::shared_ptr<Outbox> box;
+};
+std::vector<Parked> parked;
+
+Cluster cluster; // Bus to the other server nodes, only running when started with --bus-port
+UdpEndpoint udpEndpoint; // Reliable UDP listener, only running when started with --udp
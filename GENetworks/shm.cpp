@@ -0,0 +1,188 @@
+#include "shm.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+namespace {
+
+const uint32_t shmMagic = 0x47454e53; // "GENS"
+const DWORD shmWaitMs = 100; // Wakeups can be missed around a close, so waits time out and recheck
+
+std::string objectName(const std::string& name, const char* suffix) {
+	return "Local\\GENetworks." + name + suffix;
+}
+
+}
+
+bool ShmTransport::validName(const std::string& name) {
+	if (name.empty() || name.size() > 64) return false;
+	return std::all_of(name.begin(), name.end(), [](unsigned char c) {
+		return std::isalnum(c) || c == '-' || c == '_';
+	});
+}
+
+std::shared_ptr<ShmTransport> ShmTransport::create(const std::string& name) {
+	std::shared_ptr<ShmTransport> t(new ShmTransport());
+	if (!validName(name) || !t->init(name, false)) return nullptr;
+	return t;
+}
+
+std::shared_ptr<ShmTransport> ShmTransport::open(const std::string& name, SOCKET control) {
+	std::shared_ptr<ShmTransport> t(new ShmTransport());
+	t->control = control;
+	if (!validName(name) || !t->init(name, true)) {
+		t->control = INVALID_SOCKET; // Still owned by the caller
+		return nullptr;
+	}
+	return t;
+}
+
+// The bot creates the mapping and events, the server opens them. Each side reads the ring the other writes.
+bool ShmTransport::init(const std::string& name, bool isServer) {
+	server = isServer;
+	std::string mappingName = objectName(name, "");
+	if (server) {
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mappingName.c_str());
+	}
+	else {
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, (DWORD)sizeof(ShmRegion), mappingName.c_str());
+		if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+			CloseHandle(mapping); // Someone else's region
+			mapping = nullptr;
+		}
+	}
+	if (!mapping) return false;
+
+	region = (ShmRegion*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmRegion));
+	if (!region) return false;
+
+	if (server) {
+		if (region->magic != shmMagic) return false;
+	}
+	else {
+		new (region) ShmRegion(); // Fresh mapping is zeroed, this only starts the atomics' lifetimes
+		region->magic = shmMagic;
+	}
+
+	auto event = [&](const char* suffix) {
+		std::string n = objectName(name, suffix);
+		return server ? OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, n.c_str())
+			: CreateEventA(nullptr, FALSE, FALSE, n.c_str());
+	};
+	HANDLE upData = event(".up.data");
+	HANDLE upSpace = event(".up.space");
+	HANDLE downData = event(".down.data");
+	HANDLE downSpace = event(".down.space");
+
+	rx = server ? &region->up : &region->down;
+	tx = server ? &region->down : &region->up;
+	rxData = server ? upData : downData;
+	rxSpace = server ? upSpace : downSpace;
+	txData = server ? downData : upData;
+	txSpace = server ? downSpace : upSpace;
+	key = (SOCKET)rxData;
+	return rxData && rxSpace && txData && txSpace;
+}
+
+// The mapping, events and control socket only go once nothing can be using them any more.
+ShmTransport::~ShmTransport() {
+	shutdown();
+	for (HANDLE e : { rxData, rxSpace, txData, txSpace }) {
+		if (e) CloseHandle(e);
+	}
+	if (region) UnmapViewOfFile(region);
+	if (mapping) CloseHandle(mapping);
+	if (control != INVALID_SOCKET) closesocket(control);
+}
+
+// The peer is gone once it flags its side closed, or, for the server, once the bot's control socket
+// becomes readable, which only happens when the bot closed it or died.
+bool ShmTransport::peerClosed() {
+	if ((server ? region->botClosed : region->serverClosed).load(std::memory_order_acquire)) return true;
+	if (control == INVALID_SOCKET) return false;
+	WSAPOLLFD p = {};
+	p.fd = control;
+	p.events = POLLRDNORM;
+	return WSAPoll(&p, 1, 0) != 0;
+}
+
+// Both positions sit in memory the other side can write, so a buggy or hostile peer can put anything in them.
+// They're read once per pass and the connection fails if they don't describe a ring, before they're used to copy.
+// With a receive timeout set, gives up with -1 once that long passes without data.
+int ShmTransport::receive(char* buf, int len) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(receiveTimeoutMs);
+	while (!closing.load()) {
+		uint32_t head = rx->head.load(std::memory_order_relaxed);
+		uint32_t tail = rx->tail.load(std::memory_order_acquire);
+		if (tail - head > shmRingSize) {
+			shutdown();
+			return -1;
+		}
+		if (tail != head) {
+			uint32_t n = std::min<uint32_t>((uint32_t)len, tail - head);
+			uint32_t at = head & (shmRingSize - 1);
+			uint32_t first = std::min(n, shmRingSize - at);
+			std::memcpy(buf, rx->data + at, first);
+			std::memcpy(buf + first, rx->data, n - first);
+			rx->head.store(head + n, std::memory_order_release);
+			SetEvent(rxSpace);
+			return (int)n;
+		}
+		if (peerClosed()) return 0;
+		DWORD wait = shmWaitMs;
+		if (receiveTimeoutMs > 0) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0) return -1;
+			wait = std::min(wait, (DWORD)left);
+		}
+		WaitForSingleObject(rxData, wait);
+	}
+	return 0;
+}
+
+bool ShmTransport::sendAll(const char* data, int len) {
+	uint32_t left = (uint32_t)len;
+	while (left > 0) {
+		if (closing.load() || peerClosed()) return false;
+		uint32_t tail = tx->tail.load(std::memory_order_relaxed);
+		uint32_t head = tx->head.load(std::memory_order_acquire);
+		if (tail - head > shmRingSize) {
+			shutdown();
+			return false;
+		}
+		uint32_t space = shmRingSize - (tail - head);
+		if (space == 0) {
+			WaitForSingleObject(txSpace, shmWaitMs);
+			continue;
+		}
+		uint32_t n = std::min(left, space);
+		uint32_t at = tail & (shmRingSize - 1);
+		uint32_t first = std::min(n, shmRingSize - at);
+		std::memcpy(tx->data + at, data, first);
+		std::memcpy(tx->data, data + first, n - first);
+		tx->tail.store(tail + n, std::memory_order_release);
+		SetEvent(txData);
+		data += n;
+		left -= n;
+	}
+	return true;
+}
+
+// Flags our side closed and wakes everyone waiting on the rings, on both sides.
+void ShmTransport::shutdown() {
+	closing.store(true);
+	if (!region) return;
+	(server ? region->serverClosed : region->botClosed).store(1, std::memory_order_release);
+	for (HANDLE e : { rxData, rxSpace, txData, txSpace }) {
+		if (e) SetEvent(e);
+	}
+}
+
+// Can come from another thread while the session's own thread is still in receive() or peerClosed(),
+// like the drain closing a bot's outbox, so this only ends the connection. The destructor frees the rest.
+void ShmTransport::close() {
+	shutdown();
+}
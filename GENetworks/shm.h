@@ -0,0 +1,76 @@
+#pragma once
+#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "transport.h"
+
+// Size of each direction's ring. A power of two so positions can be masked.
+const uint32_t shmRingSize = 1u << 20;
+
+// One direction of a shared-memory connection. A single-producer/single-consumer byte ring:
+// the producer only moves tail, the consumer only moves head, and both are free running counters.
+struct ShmRing {
+	alignas(64) std::atomic<uint32_t> head;
+	alignas(64) std::atomic<uint32_t> tail;
+	alignas(64) char data[shmRingSize];
+};
+
+// Layout of the shared region. "up" carries bot -> server bytes, "down" carries server -> bot bytes.
+struct ShmRegion {
+	uint32_t magic;
+	alignas(64) std::atomic<uint32_t> botClosed;
+	std::atomic<uint32_t> serverClosed;
+	ShmRing up;
+	ShmRing down;
+};
+
+// Shared-memory transport for bots running on the same machine as the server. Bytes go through a pair of
+// rings in a named file mapping, with named events as wakeups, so no socket calls happen per message.
+// The protocol on the rings is the same line protocol as on TCP, starting with the username.
+//
+// To attach, a bot calls create() with a unique name, connects to the server's Unix socket (--unix)
+// and sends "/shm <name>" as its first line. It keeps that socket open while the session lasts:
+// the server watches it so a bot that dies without closing the rings still gets removed.
+class ShmTransport : public Transport {
+public:
+	// Bot side, creates the region and events.
+	static std::shared_ptr<ShmTransport> create(const std::string& name);
+	// Server side, opens the region a bot created. control is the bot's Unix socket, closed with the transport.
+	static std::shared_ptr<ShmTransport> open(const std::string& name, SOCKET control);
+
+	// Names are 1-64 characters of letters, digits, '-' and '_'.
+	static bool validName(const std::string& name);
+
+	~ShmTransport() override;
+
+	// The id is the handle of one of the transport's events. Sockets are handles too, so it can't clash with one.
+	SOCKET id() const override { return key; }
+	int receive(char* buf, int len) override;
+	bool sendAll(const char* data, int len) override;
+	void setReceiveTimeout(int ms) override { receiveTimeoutMs = ms; }
+	bool local() const override { return true; }
+	void shutdown() override;
+	void close() override;
+
+private:
+	ShmTransport() = default;
+	bool init(const std::string& name, bool server);
+	bool peerClosed();
+
+	bool server = false;
+	SOCKET key = INVALID_SOCKET;
+	SOCKET control = INVALID_SOCKET;
+	HANDLE mapping = nullptr;
+	ShmRegion* region = nullptr;
+	ShmRing* rx = nullptr;
+	ShmRing* tx = nullptr;
+	HANDLE rxData = nullptr; // Signalled by the peer when it writes to rx
+	HANDLE rxSpace = nullptr; // Signalled by us when we read from rx
+	HANDLE txData = nullptr; // Signalled by us when we write to tx
+	HANDLE txSpace = nullptr; // Signalled by the peer when it reads from tx
+	std::atomic<bool> closing{ false };
+	int receiveTimeoutMs = 0; // Only used by the thread that receives
+};
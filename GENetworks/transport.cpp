@@ -0,0 +1,149 @@
+#include "transport.h"
+
+#include <vector>
+
+bool Transport::sendAllv(const SendBuf* bufs, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (!sendAll(bufs[i].data, (int)bufs[i].len)) return false;
+	}
+	return true;
+}
+
+long long Transport::trySend(const SendBuf* bufs, size_t count) {
+	long long total = 0;
+	for (size_t i = 0; i < count; i++) total += (long long)bufs[i].len;
+	return sendAllv(bufs, count) ? total : -1;
+}
+
+// Asks the socket what it is rather than being told, so sessions handed over on a restart are recognised too.
+SocketTransport::SocketTransport(SOCKET s) : s(s) {
+	u_long nonBlocking = 1;
+	ioctlsocket(s, FIONBIO, &nonBlocking);
+	sockaddr_storage address = {};
+	int len = sizeof(address);
+	unixSocket = getsockname(s, (sockaddr*)&address, &len) == 0 && address.ss_family == AF_UNIX;
+}
+
+int SocketTransport::receive(char* buf, int len) {
+	return recv(s, buf, len, 0);
+}
+
+// SendAll implementation to make sure all bytes are sent. Waits for the socket to take more when its buffer is full.
+bool SocketTransport::sendAll(const char* data, int len) {
+	int sentSum = 0;
+	while (sentSum < len) {
+		int sent = send(s, data + sentSum, len - sentSum, 0);
+		if (sent == SOCKET_ERROR) {
+			if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+			WSAPOLLFD p = {};
+			p.fd = s;
+			p.events = POLLWRNORM;
+			WSAPoll(&p, 1, -1);
+			continue;
+		}
+		sentSum += sent;
+	}
+	return true;
+}
+
+size_t SocketTransport::gatherBufs(const SendBuf* bufs, size_t count) {
+	gather.clear();
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (bufs[i].len == 0) continue;
+		WSABUF b;
+		b.buf = (CHAR*)bufs[i].data;
+		b.len = (ULONG)bufs[i].len;
+		gather.push_back(b);
+		total += bufs[i].len;
+	}
+	return total;
+}
+
+long long SocketTransport::trySend(const SendBuf* bufs, size_t count) {
+	if (gatherBufs(bufs, count) == 0) return 0;
+	DWORD sent = 0;
+	if (WSASend(s, gather.data(), (DWORD)gather.size(), &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+		return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+	return sent;
+}
+
+// Zero-copy send. With the socket's send buffer switched off, an overlapped WSASend transmits straight from
+// our buffers instead of copying them into the kernel; this is Windows' counterpart of MSG_ZEROCOPY. The system
+// thread pool waits for the completion and calls done once the buffers are ours again.
+bool SocketTransport::sendAsync(const SendBuf* bufs, size_t count, std::function<void(bool)> done) {
+	size_t total = gatherBufs(bufs, count);
+	if (total == 0) return false;
+	if (sendEvent == WSA_INVALID_EVENT) sendEvent = WSACreateEvent();
+	if (sendEvent == WSA_INVALID_EVENT) return false;
+	int optLen = sizeof(oldSendBuffer);
+	int zero = 0;
+	if (getsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&oldSendBuffer, &optLen) != 0
+		|| setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&zero, sizeof(zero)) != 0) return false;
+
+	sendDone = std::move(done);
+	sendTotal = (DWORD)total;
+	sendOverlapped = {};
+	sendOverlapped.hEvent = sendEvent;
+	WSAResetEvent(sendEvent);
+	DWORD sent = 0;
+	if (WSASend(s, gather.data(), (DWORD)gather.size(), &sent, 0, &sendOverlapped, nullptr) == SOCKET_ERROR
+		&& WSAGetLastError() != WSA_IO_PENDING) {
+		setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&oldSendBuffer, sizeof(oldSendBuffer));
+		sendDone = nullptr;
+		return false;
+	}
+	// A send that finished straight away still sets the event, so the completion always comes through here
+	AsyncSend* pending = new AsyncSend{ this };
+	HANDLE wait = nullptr;
+	if (!RegisterWaitForSingleObject(&wait, sendEvent, onSendDone, pending, INFINITE, WT_EXECUTEONLYONCE)) {
+		DWORD flags = 0;
+		WSAGetOverlappedResult(s, &sendOverlapped, &sent, TRUE, &flags);
+		finishAsyncSend(pending, true, nullptr); // No wait to unregister, the callback below frees it
+		onSendDone(pending, FALSE);
+		return true;
+	}
+	finishAsyncSend(pending, true, wait);
+	return true;
+}
+
+// Records one side of an async send as done. The second side to get here unregisters the wait and frees pending.
+void SocketTransport::finishAsyncSend(AsyncSend* pending, bool registered, HANDLE wait) {
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(pending->mx);
+		if (registered) {
+			pending->registered = true;
+			pending->wait = wait;
+		}
+		else pending->completed = true;
+		last = pending->registered && pending->completed;
+		wait = pending->wait;
+	}
+	if (!last) return;
+	if (wait) UnregisterWait(wait);
+	delete pending;
+}
+
+void CALLBACK SocketTransport::onSendDone(PVOID context, BOOLEAN timedOut) {
+	AsyncSend* pending = (AsyncSend*)context;
+	SocketTransport* t = pending->transport;
+	DWORD sent = 0;
+	DWORD flags = 0;
+	bool ok = WSAGetOverlappedResult(t->s, &t->sendOverlapped, &sent, FALSE, &flags) == TRUE && sent == t->sendTotal;
+	setsockopt(t->s, SOL_SOCKET, SO_SNDBUF, (const char*)&t->oldSendBuffer, sizeof(t->oldSendBuffer));
+	auto done = std::move(t->sendDone);
+	t->sendDone = nullptr;
+	finishAsyncSend(pending, false, nullptr); // Before done, which may start the next send
+	done(ok);
+}
+
+void SocketTransport::shutdown() {
+	::shutdown(s, SD_BOTH);
+}
+
+void SocketTransport::close() {
+	closesocket(s);
+	if (sendEvent != WSA_INVALID_EVENT) WSACloseEvent(sendEvent);
+	sendEvent = WSA_INVALID_EVENT;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Payloads at least this big are shared between recipients instead of copied,
+// and socket transports send them without copying them into the kernel.
+const size_t zeroCopyMin = 16 * 1024;
+
+// Longest line a client may send. A connection that sends more than this without a newline is dropped,
+// instead of buffering it until memory runs out.
+const size_t maxLineBytes = 64 * 1024;
+
+struct SendBuf {
+	const char* data;
+	size_t len;
+};
+
+// Byte stream a client session runs over. The session code (clientAdd, the outbox writer) only talks to this,
+// so TCP clients, Unix socket clients and shared-memory bots all get the same handling.
+class Transport {
+public:
+	virtual ~Transport() = default;
+
+	// Key the session is stored under in the server's maps. Unique among all live transports.
+	virtual SOCKET id() const = 0;
+
+	// Reads up to len bytes. Returns the number read, or <= 0 once the stream is closed.
+	virtual int receive(char* buf, int len) = 0;
+
+	// Writes every byte or returns false.
+	virtual bool sendAll(const char* data, int len) = 0;
+
+	// Writes every buffer in order. The default sends them one by one, transports that can gather override it.
+	virtual bool sendAllv(const SendBuf* bufs, size_t count);
+
+	// Socket the event loop can poll for this transport, or INVALID_SOCKET if there is none. Sessions on a
+	// pollable transport run on the event loop, the others get a thread of their own.
+	virtual SOCKET pollSocket() const { return INVALID_SOCKET; }
+
+	// Sends as much as fits without blocking. Returns the number of bytes taken, 0 if nothing fit, or -1 on error.
+	// The default can only block, so it sends everything.
+	virtual long long trySend(const SendBuf* bufs, size_t count);
+
+	// Starts sending the buffers in the background and calls done(ok) from another thread once they can be released.
+	// Returns false if the transport can't, then the caller sends them with trySend.
+	virtual bool sendAsync(const SendBuf* bufs, size_t count, std::function<void(bool)> done) { return false; }
+
+	// Makes receive() give up and return <= 0 after ms milliseconds without data. 0 waits forever.
+	// Used to bound the handshake. Transports that can't time out ignore it.
+	virtual void setReceiveTimeout(int ms) {}
+
+	// True for connections from this machine: Unix socket clients and shared-memory bots. Those are our own
+	// bridges and bots, so they get their own rate limits instead of the ones for remote clients.
+	virtual bool local() const { return false; }
+
+	// Wakes a blocked receive() so the session notices the connection is going away.
+	virtual void shutdown() = 0;
+
+	virtual void close() = 0;
+};
+
+// Transport over a connected TCP or Unix domain socket. The id is the socket itself.
+// The socket is switched to non-blocking mode for the event loop: receive() returns -1 with WSAEWOULDBLOCK
+// when there's nothing to read, and sendAll() waits for room itself.
+class SocketTransport : public Transport {
+public:
+	explicit SocketTransport(SOCKET s);
+
+	SOCKET id() const override { return s; }
+	SOCKET pollSocket() const override { return s; }
+	bool local() const override { return unixSocket; }
+	int receive(char* buf, int len) override;
+	bool sendAll(const char* data, int len) override;
+	long long trySend(const SendBuf* bufs, size_t count) override;
+	bool sendAsync(const SendBuf* bufs, size_t count, std::function<void(bool)> done) override;
+	void shutdown() override;
+	void close() override;
+
+private:
+	// One zero-copy send in flight, shared by sendAsync and the completion callback. The callback can run
+	// before RegisterWaitForSingleObject has returned the wait handle, so whichever of the two gets here
+	// second unregisters the wait and frees this.
+	struct AsyncSend {
+		SocketTransport* transport;
+		std::mutex mx;
+		HANDLE wait = nullptr;
+		bool registered = false; // sendAsync is done with the registration, wait holds its handle
+		bool completed = false; // The callback has run
+	};
+
+	static void CALLBACK onSendDone(PVOID context, BOOLEAN timedOut);
+	static void finishAsyncSend(AsyncSend* pending, bool registered, HANDLE wait);
+	size_t gatherBufs(const SendBuf* bufs, size_t count);
+
+	SOCKET s;
+	bool unixSocket = false;
+	std::vector<WSABUF> gather; // Reused by every send, only one runs at a time
+
+	// Zero-copy send in flight, see sendAsync
+	WSAEVENT sendEvent = WSA_INVALID_EVENT;
+	WSAOVERLAPPED sendOverlapped = {};
+	std::function<void(bool)> sendDone;
+	DWORD sendTotal = 0;
+	int oldSendBuffer = 0;
+};
@@ -0,0 +1,536 @@
+#include "udp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+enum PacketType : uint8_t { SYN = 1, SYNACK = 2, DATA = 3, ACK = 4, FIN = 5 };
+const uint8_t synAccepted = 1; // SYNACK flag: the session exists, without it the SYNACK is a cookie challenge
+
+const size_t headerSize = 16; // type, flags, 2 reserved, seq, ack, sack
+const size_t frameHeaderSize = 5; // lane, lane seq (16 bits), length (16 bits)
+const size_t maxPayload = 1200; // Stays under common path MTUs
+const size_t sendBufferLimit = 256 * 1024;
+const uint32_t receiveWindow = 4096; // Packets buffered ahead of the next expected one
+const double maxCwnd = 1024;
+const int maxRetransmits = 12;
+const auto idleTimeout = std::chrono::seconds(30);
+const auto keepaliveInterval = std::chrono::seconds(5);
+const auto tick = std::chrono::milliseconds(5);
+const auto cookiePeriod = std::chrono::seconds(30); // A cookie is good for the period it was made in and the next
+
+void put32(std::string& out, uint32_t v) {
+	uint32_t n = htonl(v);
+	out.append((const char*)&n, 4);
+}
+
+uint32_t get32(const char* p) {
+	uint32_t n;
+	std::memcpy(&n, p, 4);
+	return ntohl(n);
+}
+
+void put16(std::string& out, uint16_t v) {
+	out.push_back((char)(v >> 8));
+	out.push_back((char)(v & 0xff));
+}
+
+uint16_t get16(const char* p) {
+	return (uint16_t)(((uint8_t)p[0] << 8) | (uint8_t)p[1]);
+}
+
+std::string packet(uint8_t type, uint32_t seq, uint32_t ack, uint32_t sack, const std::string* payload = nullptr, uint8_t flags = 0) {
+	std::string out;
+	out.reserve(headerSize + (payload ? payload->size() : 0));
+	out.push_back((char)type);
+	out.push_back((char)flags);
+	out.append(2, '\0');
+	put32(out, seq);
+	put32(out, ack);
+	put32(out, sack);
+	if (payload) out += *payload;
+	return out;
+}
+
+std::string peerKey(const sockaddr_in& a) {
+	char ip[INET_ADDRSTRLEN] = {};
+	inet_ntop(AF_INET, &a.sin_addr, ip, sizeof(ip));
+	return std::string(ip) + ":" + std::to_string(ntohs(a.sin_port));
+}
+
+// splitmix64's finalizer
+uint64_t mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	return h ^ (h >> 31);
+}
+
+std::atomic<SOCKET> nextSessionId{ (SOCKET)0x40000001 };
+
+}
+
+UdpSession::UdpSession(UdpEndpoint* endpoint, const sockaddr_in& peer)
+	: endpoint(endpoint), peerAddress(peer), sessionId(nextSessionId.fetch_add(2)) {
+	lastHeard = lastSent = std::chrono::steady_clock::now();
+}
+
+int UdpSession::receive(char* buf, int len) {
+	std::unique_lock<std::mutex> lock(mx);
+	auto ready = [&] { return !stream.empty() || closed || peerFinished; };
+	if (receiveTimeoutMs > 0) {
+		if (!cv.wait_for(lock, std::chrono::milliseconds(receiveTimeoutMs), ready)) return -1;
+	}
+	else cv.wait(lock, ready);
+	if (stream.empty()) return 0;
+	size_t n = std::min(stream.size(), (size_t)len);
+	std::memcpy(buf, stream.data(), n);
+	stream.erase(0, n);
+	return (int)n;
+}
+
+void UdpSession::setReceiveTimeout(int ms) {
+	std::lock_guard<std::mutex> lock(mx);
+	receiveTimeoutMs = ms;
+}
+
+// Queues each line on its lane and sends as much as the congestion window allows. Blocks only while the queues are full.
+bool UdpSession::sendAll(const char* data, int len) {
+	size_t off = 0;
+	std::unique_lock<std::mutex> lock(mx);
+	while (off < (size_t)len) {
+		if (queuedBytes >= sendBufferLimit) {
+			pump();
+			cv.wait(lock, [&] { return closed || peerFinished || queuedBytes < sendBufferLimit; });
+		}
+		if (closed || peerFinished) return false;
+		if (!midLine) sendLane = endpoint->laneOf ? (uint8_t)(endpoint->laneOf(data + off, (size_t)len - off) % laneCount) : 0;
+		const char* end = (const char*)std::memchr(data + off, '\n', (size_t)len - off);
+		size_t n = std::min(end ? (size_t)(end - (data + off)) + 1 : (size_t)len - off, sendBufferLimit - queuedBytes);
+		std::string& queue = laneQueues[sendLane];
+		if (queue.size() == laneHeads[sendLane]) readyLanes.push_back(sendLane);
+		queue.append(data + off, n);
+		queuedBytes += n;
+		off += n;
+		midLine = data[off - 1] != '\n';
+	}
+	pump();
+	return true;
+}
+
+// Fills packets with frames of queued bytes while the window has room, the lanes taking turns.
+void UdpSession::pump() {
+	while (!readyLanes.empty() && unacked.size() < (size_t)cwnd) {
+		Segment& seg = unacked[nextSeq];
+		while (!readyLanes.empty() && seg.data.size() + frameHeaderSize < maxPayload) {
+			uint8_t lane = readyLanes.front();
+			readyLanes.pop_front();
+			std::string& queue = laneQueues[lane];
+			size_t& head = laneHeads[lane];
+			size_t n = std::min(maxPayload - frameHeaderSize - seg.data.size(), queue.size() - head);
+			seg.data.push_back((char)lane);
+			put16(seg.data, nextLaneSeq[lane]++);
+			put16(seg.data, (uint16_t)n);
+			seg.data.append(queue, head, n);
+			head += n;
+			queuedBytes -= n;
+			if (head == queue.size()) {
+				queue.clear();
+				head = 0;
+			}
+			else {
+				if (head > sendBufferLimit / 2) {
+					queue.erase(0, head);
+					head = 0;
+				}
+				readyLanes.push_back(lane);
+			}
+		}
+		sendSegment(nextSeq, seg);
+		nextSeq++;
+	}
+}
+
+void UdpSession::shutdown() {
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		if (!closed) {
+			closed = true;
+			endpoint->transmit(peerAddress, packet(FIN, nextSeq, expected, 0));
+		}
+	}
+	cv.notify_all();
+}
+
+void UdpSession::close() {
+	shutdown();
+	endpoint->forget(this);
+}
+
+// Bitmap of which of the 32 packets after the next expected one have already arrived.
+static uint32_t sackBits(const std::set<uint32_t>& received, uint32_t expected) {
+	uint32_t bits = 0;
+	for (auto it = received.upper_bound(expected); it != received.end() && *it - expected <= 32; ++it)
+		bits |= 1u << (*it - expected - 1);
+	return bits;
+}
+
+void UdpSession::sendSegment(uint32_t seq, Segment& seg) {
+	seg.sentAt = lastSent = std::chrono::steady_clock::now();
+	endpoint->transmit(peerAddress, packet(DATA, seq, expected, sackBits(received, expected), &seg.data));
+}
+
+void UdpSession::sendAck() {
+	lastSent = std::chrono::steady_clock::now();
+	endpoint->transmit(peerAddress, packet(ACK, nextSeq, expected, sackBits(received, expected)));
+}
+
+void UdpSession::onPacket(uint8_t type, uint32_t seq, uint32_t ack, uint32_t sack, const char* payload, size_t len) {
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		lastHeard = std::chrono::steady_clock::now();
+
+		if (type == DATA || type == ACK) onAck(ack, sack);
+
+		// A packet is new if it's not behind expected and not already in received. Each of its frames is
+		// delivered as soon as its lane is up to it, whatever is missing on the other lanes. Once the
+		// session is closed nothing more is taken in.
+		if (type == DATA && !closed && seq - expected < receiveWindow && received.insert(seq).second) {
+			while (!received.empty() && *received.begin() == expected) {
+				received.erase(received.begin());
+				expected++;
+			}
+			bool ok = true;
+			while (ok && len >= frameHeaderSize) {
+				uint8_t lane = (uint8_t)payload[0];
+				uint16_t laneSeq = get16(payload + 1);
+				size_t n = get16(payload + 3);
+				if (lane >= laneCount || n > len - frameHeaderSize) break;
+				const char* bytes = payload + frameHeaderSize;
+				payload += frameHeaderSize + n;
+				len -= frameHeaderSize + n;
+
+				ReceiveLane& r = receiveLanes[lane];
+				if (laneSeq != r.next) {
+					r.waiting.emplace(laneSeq, std::string(bytes, n));
+					continue;
+				}
+				ok = deliver(r, bytes, n);
+				for (auto it = r.waiting.find(r.next); ok && it != r.waiting.end(); it = r.waiting.find(r.next)) {
+					ok = deliver(r, it->second.data(), it->second.size());
+					r.waiting.erase(it);
+				}
+				if (!ok) { // The peer has gone past maxLineBytes without ending a line, reset the session
+					r = ReceiveLane();
+					closed = true;
+					endpoint->transmit(peerAddress, packet(FIN, nextSeq, expected, 0));
+				}
+			}
+		}
+		if (type == DATA) sendAck(); // Duplicates are acked too, our earlier ACK may have been lost
+		else if (type == FIN) {
+			peerFinished = true;
+		}
+	}
+	cv.notify_all();
+}
+
+// Hands a lane's next frame to the reader. Only whole lines go into the stream, a line cut across frames
+// waits in the lane until its end comes so it can't be split by another lane's lines.
+// Returns false if that would make the waiting part longer than maxLineBytes.
+bool UdpSession::deliver(ReceiveLane& lane, const char* payload, size_t len) {
+	lane.next++;
+	const char* lastNewline = nullptr;
+	for (const char* p = payload + len; p > payload; p--) {
+		if (p[-1] == '\n') {
+			lastNewline = p;
+			break;
+		}
+	}
+	if (!lastNewline) {
+		if (lane.partial.size() + len > maxLineBytes) return false;
+		lane.partial.append(payload, len);
+		return true;
+	}
+	stream += lane.partial;
+	lane.partial.clear();
+	stream.append(payload, lastNewline - payload);
+	lane.partial.append(lastNewline, payload + len - lastNewline);
+	return lane.partial.size() <= maxLineBytes;
+}
+
+void UdpSession::onAck(uint32_t ack, uint32_t sack) {
+	auto now = std::chrono::steady_clock::now();
+	size_t acked = 0;
+	auto done = [&](std::map<uint32_t, Segment>::iterator it) {
+		if (it->second.retransmits == 0) { // Karn's rule, retransmitted packets give ambiguous samples
+			double r = std::chrono::duration<double, std::milli>(now - it->second.sentAt).count();
+			if (srtt == 0) {
+				srtt = r;
+				rttvar = r / 2;
+			}
+			else {
+				rttvar = 0.75 * rttvar + 0.25 * std::abs(srtt - r);
+				srtt = 0.875 * srtt + 0.125 * r;
+			}
+			rto = std::chrono::milliseconds(std::clamp((long long)(srtt + 4 * rttvar), 50LL, 3000LL));
+		}
+		acked++;
+		return unacked.erase(it);
+	};
+
+	for (auto it = unacked.begin(); it != unacked.end() && it->first < ack;) it = done(it);
+	for (uint32_t i = 0; i < 32; i++) {
+		if (!(sack & (1u << i))) continue;
+		auto it = unacked.find(ack + 1 + i);
+		if (it != unacked.end()) done(it);
+	}
+
+	for (size_t i = 0; i < acked; i++)
+		cwnd = std::min(maxCwnd, cwnd < ssthresh ? cwnd + 1 : cwnd + 1 / cwnd);
+	if (acked > 0) pump();
+
+	// Packets after the hole keep arriving: after three such ACKs, resend the hole without waiting for the timer.
+	auto hole = unacked.find(ack);
+	if (sack != 0 && hole != unacked.end()) {
+		if (dupHole == ack) dupCount++;
+		else {
+			dupHole = ack;
+			dupCount = 1;
+		}
+		if (dupCount == 3) {
+			hole->second.retransmits++;
+			sendSegment(hole->first, hole->second);
+			if (hole->first >= recoverUntil) onLoss(false);
+		}
+	}
+}
+
+void UdpSession::onLoss(bool timeout) {
+	ssthresh = std::max((double)unacked.size() / 2, 2.0);
+	cwnd = timeout ? 1 : ssthresh;
+	recoverUntil = nextSeq;
+}
+
+void UdpSession::onTimer(std::chrono::steady_clock::time_point now) {
+	bool wake = false;
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		if (closed) return;
+
+		if (now - lastHeard > idleTimeout) {
+			closed = true;
+			wake = true;
+		}
+		else {
+			bool expired = false;
+			bool react = false;
+			for (auto& u : unacked) {
+				// Each packet backs off on its own, doubling its timeout for every retransmit
+				auto timeout = std::min(rto * (1 << std::min(u.second.retransmits, 6)), std::chrono::milliseconds(3000));
+				if (now - u.second.sentAt < timeout) continue;
+				if (++u.second.retransmits > maxRetransmits) {
+					closed = true;
+					wake = true;
+					break;
+				}
+				expired = true;
+				react = react || u.first >= recoverUntil;
+				sendSegment(u.first, u.second);
+			}
+			if (expired && react) onLoss(true);
+			if (!closed && now - lastSent > keepaliveInterval) sendAck();
+		}
+	}
+	if (wake) cv.notify_all();
+}
+
+UdpEndpoint::~UdpEndpoint() {
+	stop();
+}
+
+bool UdpEndpoint::open(unsigned short port) {
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET) {
+		std::cerr << "UDP socket failed: " << WSAGetLastError() << std::endl;
+		return false;
+	}
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = INADDR_ANY;
+	if (bind(s, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+		std::cerr << "UDP bind on port " << port << " failed: " << WSAGetLastError() << std::endl;
+		closesocket(s);
+		s = INVALID_SOCKET;
+		return false;
+	}
+	std::random_device seed;
+	cookieSecret = (uint64_t)seed() << 32 | seed();
+	running.store(true);
+	receiver = std::thread(&UdpEndpoint::receiveLoop, this);
+	timer = std::thread(&UdpEndpoint::timerLoop, this);
+	return true;
+}
+
+bool UdpEndpoint::listen(unsigned short port, std::function<void(std::shared_ptr<UdpSession>)> accept) {
+	onAccept = std::move(accept);
+	return open(port);
+}
+
+std::shared_ptr<UdpSession> UdpEndpoint::connect(const char* host, unsigned short port, int timeoutMs) {
+	sockaddr_in server = {};
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server.sin_addr) <= 0 || !open(0)) return nullptr;
+
+	auto session = std::make_shared<UdpSession>(this, server);
+	std::unique_lock<std::mutex> lock(mx);
+	sessions[peerKey(server)] = session;
+
+	// Resend the SYN until the server answers, it can be lost like any other packet. The first answer is
+	// a cookie challenge, the SYNs after it carry the cookie.
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	while (!connectAnswered && std::chrono::steady_clock::now() < deadline) {
+		uint32_t sent = connectCookie;
+		transmit(server, packet(SYN, 0, sent, 0));
+		connectCv.wait_for(lock, std::chrono::milliseconds(200), [&] { return connectAnswered || connectCookie != sent; });
+	}
+	if (connectAnswered) return session;
+
+	sessions.clear();
+	lock.unlock();
+	stop();
+	return nullptr;
+}
+
+void UdpEndpoint::setImpairment(const Impairment& i) {
+	std::lock_guard<std::mutex> lock(impairMx);
+	impairment = i;
+}
+
+void UdpEndpoint::stop() {
+	if (!running.exchange(false)) return;
+	::shutdown(s, SD_BOTH);
+	closesocket(s);
+	if (receiver.joinable()) receiver.join();
+	if (timer.joinable()) timer.join();
+	s = INVALID_SOCKET;
+}
+
+// Every outgoing packet goes through here so the impairment settings can drop or hold it back.
+void UdpEndpoint::transmit(const sockaddr_in& to, const std::string& packet) {
+	{
+		std::lock_guard<std::mutex> lock(impairMx);
+		if (impairment.loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < impairment.loss) return;
+		if (impairment.delayMs > 0 || impairment.jitterMs > 0) {
+			int ms = impairment.delayMs;
+			if (impairment.jitterMs > 0) ms += std::uniform_int_distribution<int>(0, impairment.jitterMs)(rng);
+			delayed.push({ std::chrono::steady_clock::now() + std::chrono::milliseconds(ms), to, packet });
+			return;
+		}
+	}
+	rawSend(to, packet);
+}
+
+void UdpEndpoint::rawSend(const sockaddr_in& to, const std::string& packet) {
+	sendto(s, packet.data(), (int)packet.size(), 0, (const sockaddr*)&to, sizeof(to));
+}
+
+void UdpEndpoint::receiveLoop() {
+	char buf[2048];
+	while (running.load()) {
+		sockaddr_in from = {};
+		socklen_t fromLen = sizeof(from);
+		int received = recvfrom(s, buf, sizeof(buf), 0, (sockaddr*)&from, &fromLen);
+		if (received < (int)headerSize) continue; // Errors included, Windows reports ICMP port unreachable here
+
+		uint8_t type = (uint8_t)buf[0];
+		uint32_t seq = get32(buf + 4);
+		uint32_t ack = get32(buf + 8);
+		uint32_t sack = get32(buf + 12);
+		std::string key = peerKey(from);
+
+		std::shared_ptr<UdpSession> session;
+		bool accepted = false;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			auto it = sessions.find(key);
+			if (it != sessions.end()) session = it->second;
+
+			if (type == SYNACK) {
+				if ((uint8_t)buf[1] & synAccepted) connectAnswered = true;
+				else connectCookie = ack;
+				connectCv.notify_all();
+				continue;
+			}
+			if (type == SYN && onAccept && (!session || session->closed)) { // A closed session at the same address is a reconnect
+				if (validCookie(from, ack)) {
+					session = std::make_shared<UdpSession>(this, from);
+					sessions[key] = session;
+					accepted = true;
+				}
+				else session = nullptr;
+			}
+		}
+
+		if (type == SYN && onAccept) {
+			if (session) transmit(from, packet(SYNACK, 0, 0, 0, nullptr, synAccepted)); // Answer repeats too, our SYNACK may have been lost
+			else transmit(from, packet(SYNACK, 0, cookie(from, cookiePeriodOf(std::chrono::steady_clock::now())), 0));
+			if (accepted) onAccept(session);
+			continue;
+		}
+		if (session) session->onPacket(type, seq, ack, sack, buf + headerSize, (size_t)received - headerSize);
+	}
+}
+
+uint64_t UdpEndpoint::cookiePeriodOf(std::chrono::steady_clock::time_point t) {
+	return (uint64_t)(t.time_since_epoch() / cookiePeriod);
+}
+
+// Keyed hash of the peer's address and port and the period. Never 0, a SYN without a cookie carries 0.
+uint32_t UdpEndpoint::cookie(const sockaddr_in& peer, uint64_t period) const {
+	uint64_t h = mix(cookieSecret ^ ((uint64_t)peer.sin_addr.s_addr << 16 | peer.sin_port));
+	h = mix(h ^ cookieSecret ^ period);
+	return (uint32_t)h | 1;
+}
+
+bool UdpEndpoint::validCookie(const sockaddr_in& peer, uint32_t value) const {
+	uint64_t period = cookiePeriodOf(std::chrono::steady_clock::now());
+	return value == cookie(peer, period) || value == cookie(peer, period - 1);
+}
+
+void UdpEndpoint::timerLoop() {
+	while (running.load()) {
+		std::this_thread::sleep_for(tick);
+		auto now = std::chrono::steady_clock::now();
+
+		std::vector<Delayed> due;
+		{
+			std::lock_guard<std::mutex> lock(impairMx);
+			while (!delayed.empty() && delayed.top().at <= now) {
+				due.push_back(delayed.top());
+				delayed.pop();
+			}
+		}
+		for (const auto& d : due) rawSend(d.to, d.packet);
+
+		std::vector<std::shared_ptr<UdpSession>> live;
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			live.reserve(sessions.size());
+			for (const auto& it : sessions) live.push_back(it.second);
+		}
+		for (const auto& session : live) session->onTimer(now);
+	}
+}
+
+void UdpEndpoint::forget(const UdpSession* session) {
+	std::lock_guard<std::mutex> lock(mx);
+	auto it = sessions.find(peerKey(session->peer()));
+	if (it != sessions.end() && it->second.get() == session) sessions.erase(it);
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "transport.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+class UdpEndpoint;
+
+// Reliable transport over UDP, carrying the same line protocol as TCP.
+// Lines are sent on one of a few lanes, each delivered in order on its own: a lost packet only holds up
+// the lines of its lane until its retransmit arrives, not the other conversations. Which lane a line takes
+// is up to the endpoint's lane function (see UdpEndpoint::setLanes), by default everything shares lane 0
+// and it's one ordered stream. Packets are numbered across the session for acknowledgement and congestion
+// control, and filled with frames: a run of one lane's bytes with its number within the lane, used for
+// delivery. So lines of many conversations still share packets. ACKs carry the next expected packet
+// number plus a bitmap of the 32 packets after it that have arrived (selective ACK).
+// Retransmit timeouts follow RFC 6298. The congestion window grows by slow start then additive increase,
+// halves on a fast retransmit (three ACKs showing the same hole), and drops to one packet on a timeout.
+class UdpSession : public Transport {
+public:
+	static const size_t laneCount = 64;
+
+	UdpSession(UdpEndpoint* endpoint, const sockaddr_in& peer);
+
+	// Ids are odd, socket handles are multiples of 4, so the two can't clash in the server's maps.
+	SOCKET id() const override { return sessionId; }
+	int receive(char* buf, int len) override;
+	bool sendAll(const char* data, int len) override;
+	void setReceiveTimeout(int ms) override;
+	void shutdown() override;
+	void close() override;
+
+	const sockaddr_in& peer() const { return peerAddress; }
+
+private:
+	friend class UdpEndpoint;
+
+	struct Segment {
+		std::string data; // Frames
+		std::chrono::steady_clock::time_point sentAt;
+		int retransmits = 0;
+	};
+
+	struct ReceiveLane {
+		uint16_t next = 0; // Number of the next frame to deliver
+		std::unordered_map<uint16_t, std::string> waiting; // Arrived ahead of next
+		std::string partial; // Start of a line whose end hasn't been delivered yet
+	};
+
+	void onPacket(uint8_t type, uint32_t seq, uint32_t ack, uint32_t sack, const char* payload, size_t len);
+	bool deliver(ReceiveLane& lane, const char* payload, size_t len);
+	void onAck(uint32_t ack, uint32_t sack);
+	void onTimer(std::chrono::steady_clock::time_point now);
+	void pump();
+	void sendSegment(uint32_t seq, Segment& seg);
+	void sendAck();
+	void onLoss(bool timeout);
+
+	UdpEndpoint* endpoint;
+	sockaddr_in peerAddress;
+	SOCKET sessionId;
+
+	std::mutex mx;
+	std::condition_variable cv;
+	bool closed = false; // We closed or gave up
+	bool peerFinished = false; // Peer sent FIN
+	int receiveTimeoutMs = 0;
+	std::chrono::steady_clock::time_point lastHeard;
+	std::chrono::steady_clock::time_point lastSent;
+
+	// Sending side. Bytes wait in their lane's queue until the window has room, so small lines share packets.
+	// Lanes with bytes waiting take turns in readyLanes, a frame each.
+	std::string laneQueues[laneCount];
+	size_t laneHeads[laneCount] = {}; // Bytes at the front of each queue already sent
+	std::deque<uint8_t> readyLanes;
+	size_t queuedBytes = 0;
+	uint16_t nextLaneSeq[laneCount] = {};
+	uint8_t sendLane = 0; // Lane of the line being queued
+	bool midLine = false; // The last sendAll ended inside a line, the rest goes on the same lane
+	uint32_t nextSeq = 0;
+	std::map<uint32_t, Segment> unacked;
+	double cwnd = 4;
+	double ssthresh = 64;
+	uint32_t dupHole = 0;
+	int dupCount = 0;
+	uint32_t recoverUntil = 0; // No new loss reaction for packets sent before the last one
+	double srtt = 0;
+	double rttvar = 0;
+	std::chrono::milliseconds rto{ 200 };
+
+	// Receiving side
+	uint32_t expected = 0; // Every packet before this one has arrived
+	std::set<uint32_t> received; // Packets after expected that have arrived
+	ReceiveLane receiveLanes[laneCount];
+	std::string stream; // Complete lines ready for receive()
+};
+
+// One UDP socket with all its sessions. The server listens with it; bots and tests can connect with one.
+// A receive thread hands packets to their session, and a timer thread drives retransmits, keepalives
+// and the impairment simulator.
+// A listening endpoint keeps no state for a SYN until it's proven it can reach the sender: the first SYN
+// gets a SYNACK carrying a cookie (a keyed hash of the sender's address and the time), and only a SYN
+// echoing a valid cookie creates a session. SYNs from spoofed addresses never see a cookie.
+class UdpEndpoint {
+public:
+	// Fault injection for loopback testing, applied to every packet this endpoint sends.
+	struct Impairment {
+		double loss = 0; // Chance of dropping a packet, 0..1
+		int delayMs = 0;
+		int jitterMs = 0;
+	};
+
+	~UdpEndpoint();
+
+	// Server side, onAccept is called on the receive thread for every new session.
+	bool listen(unsigned short port, std::function<void(std::shared_ptr<UdpSession>)> onAccept);
+	// Client side, binds an ephemeral port and handshakes with the server.
+	std::shared_ptr<UdpSession> connect(const char* host, unsigned short port, int timeoutMs = 3000);
+
+	void setImpairment(const Impairment& i);
+	void stop();
+
+	// Picks the lane of each line this endpoint's sessions send, from the start of the line (the rest of what
+	// was passed to sendAll). Lines that must stay in order with each other need the same lane. Call before
+	// listen or connect.
+	void setLanes(std::function<uint8_t(const char* line, size_t len)> laneOf) { this->laneOf = std::move(laneOf); }
+
+private:
+	friend class UdpSession;
+
+	bool open(unsigned short port);
+	void transmit(const sockaddr_in& to, const std::string& packet);
+	void rawSend(const sockaddr_in& to, const std::string& packet);
+	void receiveLoop();
+	void timerLoop();
+	void forget(const UdpSession* session);
+	static uint64_t cookiePeriodOf(std::chrono::steady_clock::time_point t);
+	uint32_t cookie(const sockaddr_in& peer, uint64_t period) const;
+	bool validCookie(const sockaddr_in& peer, uint32_t value) const;
+
+	struct Delayed {
+		std::chrono::steady_clock::time_point at;
+		sockaddr_in to;
+		std::string packet;
+		bool operator>(const Delayed& o) const { return at > o.at; }
+	};
+
+	SOCKET s = INVALID_SOCKET;
+	std::atomic<bool> running{ false };
+	std::thread receiver;
+	std::thread timer;
+	std::function<void(std::shared_ptr<UdpSession>)> onAccept;
+	std::function<uint8_t(const char*, size_t)> laneOf;
+
+	std::mutex mx; // Guards sessions and connecting
+	std::unordered_map<std::string, std::shared_ptr<UdpSession>> sessions; // Peer "ip:port" -> session
+	std::condition_variable connectCv;
+	bool connectAnswered = false;
+	uint32_t connectCookie = 0; // From the server's challenge, sent back in our SYNs
+	uint64_t cookieSecret = 0;
+
+	std::mutex impairMx; // Guards the impairment settings, rng and delayed queue
+	Impairment impairment;
+	std::mt19937 rng{ std::random_device{}() };
+	std::priority_queue<Delayed, std::vector<Delayed>, std::greater<Delayed>> delayed;
+};
@@ -0,0 +1,50 @@
+#include "chatstate.h"
+
+// Pops the sound event from the sound events queue after its played.
+bool ChatState::popSoundEvent(SoundEvent& out)
+{
+    if (sounds.empty()) return false;
+    out = sounds.front();
+    sounds.pop();
+    return true;
+}
+
+// Used to get incoming information and process it into the chat state.
+// The receive thread has already worked out whether each line updates the users, is a DM, or is said in the room,
+// so this only stores what it has to keep.
+void ChatState::getMessages(const std::string& self)
+{
+    size_t count = incoming.available();
+    for (size_t i = 0; i < count; i++)
+    {
+        const ChatEvent& ev = incoming.at(i); // Stays in the ring, copied out only where it's kept
+
+        switch (ev.type)
+        {
+        case EventType::Roster: // This is used to build the clients list on the left side.
+            users.assign(ev.users.begin(), ev.users.end());
+            break;
+
+        case EventType::DM:
+            DMs.add(std::string(ev.name), ev.text);
+            if (ev.name != self)
+                sounds.push(SoundEvent::DM);
+            break;
+
+        case EventType::DMEcho:
+            DMs.add(std::string(ev.name), ev.text);
+            break;
+
+        case EventType::RoomMessage:
+        case EventType::System:
+            if (ev.type == EventType::RoomMessage && !ev.name.empty() && ev.name != self)
+                sounds.push(SoundEvent::Broadcast);
+
+            roomMessages.push(ev.text); // Broadcast messages
+            break;
+        }
+        if (onEvent)
+            onEvent(ev);
+    }
+    incoming.release(count); // Hand the whole batch back to the receive thread
+}
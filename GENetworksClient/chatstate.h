@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <queue>
+#include <atomic>
+#include <functional>
+
+#include "dmstore.h"
+#include "events.h"
+#include "history.h"
+#include "scheduler.h"
+#include "spsc.h"
+
+enum class SoundEvent { Broadcast, DM }; // Play a different sound based on if its a DM or a Broadcast
+
+enum class ConnectionState { Connecting, Connected, Waiting, Disconnected }; // Waiting means until retryAtMs
+
+// Everything the client knows about the chat, kept up to date from what the server sends. Nothing in here draws,
+// so the same client runs behind the window or headless (bots, soak tests, benchmarks).
+// The receive and connection threads only touch the atomics, incoming and frames; the rest belongs to the thread
+// calling getMessages.
+class ChatState {
+public:
+    std::vector<std::string> users;
+    std::queue<SoundEvent> sounds;
+    MessageHistory roomMessages{ 5000 }; // Broadcast messages, oldest dropped past 5000
+    DMStore DMs; // Private conversations by the other person's name
+
+    // Written by the connection and receive threads, shown above the chat
+    std::atomic<ConnectionState> connection{ ConnectionState::Connecting };
+    std::atomic<long long> retryAtMs{ 0 }; // steady_clock time of the next connection attempt
+    std::atomic<int> reconnectHintMs{ -1 }; // Delay from the server's last RECONNECT line, -1 if there isn't one
+
+    // Events from the receive thread. It decodes and publishes a batch per recv, getMessages applies them all each frame.
+    SpscRing<ChatEvent, 16384> incoming;
+
+    // When the state last changed. The receive and connection threads mark it dirty, a window adds its own deadlines.
+    FrameScheduler frames;
+
+    // Called by getMessages with each event after it's applied, for anyone following along (like the headless client).
+    std::function<void(const ChatEvent&)> onEvent;
+
+    bool popSoundEvent(SoundEvent& out);
+
+    void getMessages(const std::string& self);
+};
@@ -1,12 +1,49 @@
 #include "client.h"
-#include "gui.h"
+#include "events.h"
+#include "framer.h"
+#include "chatstate.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+const int sendFlags = MSG_NOSIGNAL; // A connection the server has closed is an error from send, not a SIGPIPE
+#else
+const int sendFlags = 0;
+#endif
+
+bool startNetworking() {
+#ifdef _WIN32
+    WSADATA wsa{};
+    return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+    return true;
+#endif
+}
+
+void stopNetworking() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+void setBlocking(SOCKET s, bool blocking) {
+#ifdef _WIN32
+    u_long nonBlocking = blocking ? 0 : 1;
+    ioctlsocket(s, FIONBIO, &nonBlocking);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
 
 // Same sendall, sendline and stripCR functions as the server
 // Helpers to make sure all bytes are sent and they have a \n at the end of the sentence and no \r characters
 bool sendAll(SOCKET s, const char* data, int len) {
     int sentSum = 0;
     while (sentSum < len) {
-        int sent = send(s, data + sentSum, len - sentSum, 0);
+        int sent = (int)send(s, data + sentSum, len - sentSum, sendFlags);
         if (sent == SOCKET_ERROR) return false;
         sentSum += sent;
     }
@@ -19,45 +56,116 @@ bool sendLine(SOCKET s, const std::string& line) {
     return sendAll(s, out.c_str(), (int)out.size());
 }
 
+// Queue a line for the send thread, with the same \n handling as sendLine
+void Outbox::post(const std::string& line) {
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        if (closed) return;
+        pending += line;
+        if (line.empty() || line.back() != '\n') pending.push_back('\n');
+    }
+    ready.notify_one();
+}
+
+// Swap out everything queued so far. out's old buffer becomes the next pending one, so neither side reallocates.
+bool Outbox::take(std::string& out) {
+    std::unique_lock<std::mutex> lock(mx);
+    ready.wait(lock, [&] { return closed || !live || !pending.empty(); });
+    if (!live || pending.empty()) return false;
+    out.clear();
+    std::swap(out, pending);
+    return true;
+}
+
+void Outbox::resume(const std::string& first) {
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        pending.insert(0, first + "\n");
+        live = true;
+    }
+    ready.notify_one();
+}
+
+void Outbox::suspend() {
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        live = false;
+    }
+    ready.notify_one();
+}
+
+void Outbox::close() {
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        closed = true;
+    }
+    ready.notify_one();
+}
+
 void stripCR(std::string& s) {
     s.erase(std::remove(s.begin(), s.end(), '\r'), s.end());
 }
 
-// Receive message from server and push it into the queue of the UI to be displayed
-void receiveMessage(SOCKET s, std::atomic<bool>& running, GUI& ui) {
-    std::string buf;
-    char buff[1048];
+// Next free slot in the UI's ring for the batch being filled. If the UI has fallen a whole ring behind, publish
+// what's filled so far and wait for it to catch up rather than drop lines. nullptr once the client is closing,
+// since the UI has stopped draining by then.
+ChatEvent* claimSlot(ChatState& chat, size_t& batch, const std::atomic<bool>& cancelled) {
+    ChatEvent* slot = chat.incoming.claim(batch);
+    while (!slot && !cancelled.load()) {
+        chat.incoming.publish(batch);
+        chat.frames.markDirty();
+        batch = 0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        slot = chat.incoming.claim(batch);
+    }
+    return slot;
+}
+
+// Receive message from server and hand it to the UI to be displayed
+// recv writes straight into the framer, and every complete line from one recv is decoded into the UI's ring and
+// published together. Lines already received still reach the UI after the connection drops, unless cancelled.
+void receiveMessage(SOCKET s, std::atomic<bool>& running, const std::atomic<bool>& cancelled, ChatState& chat) {
+    LineFramer framer;
 
     while (running.load()) {
-        int received = recv(s, buff, sizeof(buff), 0); // Receive from server while the socket is running
+        int received = (int)recv(s, framer.writePtr(), (int)framer.writable(), 0); // Receive from server while the socket is running
         if (received <= 0) {
             running.store(false);
             break;
         }
-
-        buf.append(buff, buff + received);
-
-        while(1) {
-            size_t pos = buf.find('\n'); // See if the message is complete
-            if (pos == std::string::npos) break;
-
-            std::string line = buf.substr(0, pos);
-            buf.erase(0, pos + 1);
-
-            stripCR(line);
-
-            ui.pushToQueue(std::move(line)); // push to GUI
-        }
+        framer.commit(received);
+
+        size_t batch = 0;
+        framer.extract([&](std::string_view first, std::string_view second) {
+            ChatEvent* ev = claimSlot(chat, batch, cancelled);
+            if (!ev) return;
+            ev->text.assign(first); // Slots keep their capacity, so this doesn't allocate once they're warm
+            ev->text.append(second);
+            stripCR(ev->text);
+            if (ev->text.rfind("RECONNECT ", 0) == 0) // The server is going away, the connection thread needs to know when to come back
+                chat.reconnectHintMs.store(std::atoi(ev->text.c_str() + 10));
+            if (decodeEvent(*ev)) batch++; // Otherwise the slot is just used for the next line
+        });
+        chat.incoming.publish(batch); // push to GUI
+        if (batch > 0) chat.frames.markDirty();
     }
 
-    if (!buf.empty()) {
-        stripCR(buf);
-        ui.pushToQueue(std::move(buf));
+    std::string rest = framer.partial();
+    size_t batch = 0;
+    ChatEvent* ev = rest.empty() ? nullptr : claimSlot(chat, batch, cancelled);
+    if (ev) {
+        stripCR(rest);
+        ev->text = std::move(rest);
+        if (decodeEvent(*ev)) batch++;
     }
+    chat.incoming.publish(batch);
+    if (batch > 0) chat.frames.markDirty();
 }
 
 // Function to connect to server. Takes in a socket reference as the client socket and host/port information and connects
-bool connectToServer(SOCKET& sock, const char* host, unsigned int port) {
+// The connect doesn't block: it gives up after timeoutMs, or as soon as cancelled is set. The socket is blocking again
+// once connected, for the receive and send threads.
+bool connectToServer(SOCKET& sock, const char* host, unsigned int port, int timeoutMs, const std::atomic<bool>& cancelled) {
     sock = INVALID_SOCKET;
 
     SOCKET client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -76,20 +184,60 @@ bool connectToServer(SOCKET& sock, const char* host, unsigned int port) {
         return false;
     }
 
+    setBlocking(client_socket, false);
     if (connect(client_socket, reinterpret_cast<sockaddr*>(&server_address), sizeof(server_address)) == SOCKET_ERROR) {
-        std::cerr << "Connection failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(client_socket);
-        return false;
+        int error = WSAGetLastError();
+        if (error != WSAEWOULDBLOCK && error != WSAEINPROGRESS) {
+            std::cerr << "Connection failed with error: " << error << std::endl;
+            closesocket(client_socket);
+            return false;
+        }
+
+        // Wait in short steps so cancelling doesn't have to wait out the whole timeout
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        bool connected = false;
+        while (!connected && !cancelled.load() && std::chrono::steady_clock::now() < deadline) {
+            WSAPOLLFD pfd = {};
+            pfd.fd = client_socket;
+            pfd.events = POLLOUT;
+            int ready = WSAPoll(&pfd, 1, 100);
+            if (ready == SOCKET_ERROR) break;
+            if (ready == 0) continue;
+
+            int socketError = 0;
+            socklen_t len = sizeof(socketError);
+            getsockopt(client_socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&socketError), &len);
+            if (socketError != 0) {
+                std::cerr << "Connection failed with error: " << socketError << std::endl;
+                break;
+            }
+            connected = true;
+        }
+        if (!connected) {
+            closesocket(client_socket);
+            return false;
+        }
     }
+    setBlocking(client_socket, true);
 
     sock = client_socket;
     return true;
 }
 
-// Create a thread to start receiving messages from the server
-void startReceive(SOCKET sock, std::atomic<bool>& running, GUI& ui, std::thread& t) {
+// Send whatever the UI has queued. Lines queued while a send is in progress go out together in the next one.
+void sendMessages(SOCKET s, std::atomic<bool>& running, Outbox& outbox) {
+    std::string batch;
+    while (outbox.take(batch)) {
+        if (!sendAll(s, batch.data(), (int)batch.size())) {
+            running.store(false);
+            break;
+        }
+    }
+}
+
+// Create a thread to send the outbox to the server
+void startSend(SOCKET sock, std::atomic<bool>& running, Outbox& outbox, std::thread& t) {
     if (t.joinable())
         t.join();
-    running.store(true);
-    t = std::thread(receiveMessage, sock, std::ref(running), std::ref(ui));
+    t = std::thread(sendMessages, sock, std::ref(running), std::ref(outbox));
 }
\ No newline at end of file
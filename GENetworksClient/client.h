@@ -1,19 +1,69 @@
 #pragma once
+// The client core builds on Windows with Winsock and anywhere else with POSIX sockets. Elsewhere the few Winsock
+// names it uses are mapped onto their POSIX equivalents, so the code below and in the .cpp files is the same.
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+
+typedef int SOCKET;
+typedef pollfd WSAPOLLFD;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+const int SD_BOTH = SHUT_RDWR;
+const int WSAEWOULDBLOCK = EWOULDBLOCK;
+const int WSAEINPROGRESS = EINPROGRESS;
+
+inline int closesocket(SOCKET s) { return close(s); }
+inline int WSAGetLastError() { return errno; }
+inline int WSAPoll(WSAPOLLFD* fds, unsigned long count, int timeoutMs) { return poll(fds, (nfds_t)count, timeoutMs); }
+#endif
+
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 
-#pragma comment(lib, "Ws2_32.lib")
+class ChatState;
+
+// Lines waiting to go to the server. The UI thread posts into it and never touches the socket, the send thread
+// takes everything posted since its last write and sends it as one.
+class Outbox {
+public:
+    void post(const std::string& line);
+    bool take(std::string& out); // Waits for lines, false once suspended, or closed and empty
+    void resume(const std::string& first); // New connection: first goes ahead of anything still queued
+    void suspend(); // Connection lost: take gives up, post keeps queueing for the next one
+    void close();
+
+private:
+    std::mutex mx;
+    std::condition_variable ready;
+    std::string pending;
+    bool live = false;
+    bool closed = false;
+};
 
-class GUI;
+// Winsock needs starting before any socket call and stopping after the last one. No-ops elsewhere.
+bool startNetworking();
+void stopNetworking();
 
 bool sendAll(SOCKET s, const char* data, int len);
 bool sendLine(SOCKET s, const std::string& line);
 
-bool connectToServer(SOCKET& sock, const char* host, unsigned int port);
-void startReceive(SOCKET sock, std::atomic<bool>& running, GUI& ui, std::thread& t);
+bool connectToServer(SOCKET& sock, const char* host, unsigned int port, int timeoutMs, const std::atomic<bool>& cancelled);
+void receiveMessage(SOCKET s, std::atomic<bool>& running, const std::atomic<bool>& cancelled, ChatState& chat);
+void startSend(SOCKET sock, std::atomic<bool>& running, Outbox& outbox, std::thread& t);
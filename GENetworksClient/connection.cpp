@@ -0,0 +1,92 @@
+#include "connection.h"
+#include "chatstate.h"
+
+#include <algorithm>
+#include <cstdint>
+
+Connection::Connection(ChatState& chat, Outbox& outbox, std::string host, unsigned int port, std::string username)
+    : chat(chat), outbox(outbox), host(std::move(host)), port(port), username(std::move(username)), random(std::random_device{}()) {}
+
+Connection::~Connection() {
+    stop();
+}
+
+void Connection::start() {
+    stopping.store(false);
+    thread = std::thread(&Connection::run, this);
+}
+
+// Shutting the socket down makes the blocked recv (and any blocked send) return, so the thread notices quickly.
+void Connection::stop() {
+    stopping.store(true);
+    outbox.close();
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        if (sock != INVALID_SOCKET) shutdown(sock, SD_BOTH);
+    }
+    wake.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+// Half the capped exponential delay plus a random part up to the other half, so it never drops to nothing.
+int Connection::backoffMs(int attempt) {
+    int delay = backoffMaxMs;
+    if (attempt < 30) delay = (int)std::min<int64_t>(backoffMaxMs, (int64_t)backoffBaseMs << attempt); // 64 bits, base << 30 doesn't fit an int
+    std::uniform_int_distribution<int> jitter(0, delay / 2);
+    return delay / 2 + jitter(random);
+}
+
+void Connection::setState(ConnectionState state) {
+    chat.connection.store(state);
+    chat.frames.markDirty();
+}
+
+bool Connection::waitFor(int ms) {
+    std::unique_lock<std::mutex> lock(mx);
+    return !wake.wait_for(lock, std::chrono::milliseconds(ms), [&] { return stopping.load(); });
+}
+
+void Connection::run() {
+    int attempt = 0;
+    while (!stopping.load()) {
+        setState(ConnectionState::Connecting);
+        SOCKET s;
+        if (connectToServer(s, host.c_str(), port, connectTimeoutMs, stopping)) {
+            {
+                std::lock_guard<std::mutex> lock(mx);
+                if (!stopping.load()) sock = s; // stop has already run otherwise and won't shut this one down
+            }
+            if (sock != INVALID_SOCKET) {
+                attempt = 0;
+                chat.reconnectHintMs.store(-1);
+                running.store(true);
+                outbox.resume(username); // Log in again before anything typed while disconnected
+                std::thread sender;
+                startSend(s, running, outbox, sender);
+                setState(ConnectionState::Connected);
+
+                receiveMessage(s, running, stopping, chat); // Returns once the connection is gone
+
+                running.store(false);
+                outbox.suspend();
+                {
+                    std::lock_guard<std::mutex> lock(mx);
+                    sock = INVALID_SOCKET;
+                }
+                shutdown(s, SD_BOTH);
+                sender.join();
+            }
+            closesocket(s);
+        }
+        if (stopping.load()) break;
+
+        int hint = chat.reconnectHintMs.exchange(-1); // The server said when to come back, and spread the clients out itself
+        int delay = hint >= 0 ? hint : backoffMs(attempt++);
+        auto retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+        chat.retryAtMs.store(std::chrono::duration_cast<std::chrono::milliseconds>(retryAt.time_since_epoch()).count());
+        setState(ConnectionState::Waiting);
+        if (!waitFor(delay)) break;
+    }
+    setState(ConnectionState::Disconnected);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "client.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <random>
+
+class ChatState;
+enum class ConnectionState;
+
+// Keeps the client connected in the background. Its thread connects, sends the username, then runs the
+// receive side of the connection itself while a second thread drains the outbox. When the connection drops it
+// waits and tries again: for as long as the server asked in its RECONNECT line, otherwise for an exponentially
+// growing, jittered delay so a crowd of clients losing the same server don't all come back at once.
+// Progress goes into the chat state's connection fields, so whoever shows it never waits on any of this.
+class Connection {
+public:
+    Connection(ChatState& chat, Outbox& outbox, std::string host, unsigned int port, std::string username);
+    ~Connection();
+
+    void start();
+    void stop(); // Closes the connection and waits for the threads
+
+    int connectTimeoutMs = 3000;
+    int backoffBaseMs = 250;
+    int backoffMaxMs = 30000;
+
+private:
+    void run();
+    int backoffMs(int attempt);
+    bool waitFor(int ms); // False if stopped while waiting
+    void setState(ConnectionState state);
+
+    ChatState& chat;
+    Outbox& outbox;
+    std::string host;
+    unsigned int port;
+    std::string username;
+
+    std::mutex mx; // Guards sock against stop
+    std::condition_variable wake;
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> running{ false }; // The current connection is up
+    SOCKET sock = INVALID_SOCKET;
+    std::thread thread;
+    std::mt19937 random;
+};
@@ -0,0 +1,225 @@
+#include "dmstore.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+// A record is the offset of the previous record of the same conversation, the line's length, then its bytes.
+// Only this process reads the file, so native byte order.
+uint64_t recordSize(std::string_view line) {
+    return sizeof(uint64_t) + sizeof(uint32_t) + line.size();
+}
+
+void putRecord(std::ostream& out, uint64_t previous, std::string_view line) {
+    uint32_t len = (uint32_t)line.size();
+    out.write((const char*)&previous, sizeof(previous));
+    out.write((const char*)&len, sizeof(len));
+    out.write(line.data(), line.size());
+}
+
+// Follows a conversation back from its newest record for count records.
+bool readChain(std::istream& in, uint64_t newest, uint64_t count, std::vector<std::string>& newestFirst) {
+    uint64_t at = newest;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t previous;
+        uint32_t len;
+        in.seekg((std::streamoff)at);
+        if (!in.read((char*)&previous, sizeof(previous)) || !in.read((char*)&len, sizeof(len))) return false;
+        std::string line(len, '\0');
+        if (len > 0 && !in.read(&line[0], len)) return false;
+        newestFirst.push_back(std::move(line));
+        at = previous;
+    }
+    return true;
+}
+
+std::string spillPathIn(const std::string& dir) {
+    return (std::filesystem::path(dir) / "conversations.dm").string();
+}
+
+}
+
+DMStore::DMStore(size_t perConversation, size_t resident)
+    : perConversation(perConversation), resident(std::max<size_t>(resident, 1)) {}
+
+DMStore::~DMStore() {
+    if (spillDir.empty()) return;
+    spillFile.close(); // Windows won't delete it while it's open
+    std::error_code error;
+    std::filesystem::remove_all(spillDir, error);
+}
+
+void DMStore::add(const std::string& peer, std::string_view line) {
+    Conversation& conversation = conversations[peer];
+    if (!conversation.lines && conversation.linesOnDisk > 0) { // Spilled: add to the file, leave it there
+        if (append(conversation, line)) return;
+        std::cerr << "Could not add to the spilled conversation with " << peer << ", reading it back" << std::endl;
+    }
+    touch(peer, conversation);
+    conversation.lines->push(line);
+}
+
+const MessageHistory& DMStore::open(const std::string& peer) {
+    Conversation& conversation = conversations[peer];
+    touch(peer, conversation);
+    return *conversation.lines;
+}
+
+// Makes the conversation resident and most recently used, spilling the least recently used one if that's too many.
+void DMStore::touch(const std::string& peer, Conversation& conversation) {
+    if (conversation.lines) {
+        lru.splice(lru.begin(), lru, conversation.lru);
+        return;
+    }
+    load(peer, conversation);
+    lru.push_front(peer);
+    conversation.lru = lru.begin();
+    while (lru.size() > resident) {
+        std::string coldest = lru.back();
+        if (!spill(coldest, conversations[coldest])) break; // Over the cap rather than lose it, tried again next time
+    }
+}
+
+// Its records stay in the file but no longer count: if it's spilled again it's written afresh.
+void DMStore::load(const std::string& peer, Conversation& conversation) {
+    conversation.lines = std::make_unique<MessageHistory>(perConversation);
+    if (conversation.linesOnDisk == 0) return; // New, or empty when it was spilled
+    std::vector<std::string> newestFirst;
+    if (!readChain(spillFile, conversation.newest, conversation.linesOnDisk, newestFirst))
+        std::cerr << "Could not read back the conversation with " << peer << std::endl;
+    spillFile.clear();
+    for (auto line = newestFirst.rbegin(); line != newestFirst.rend(); ++line) conversation.lines->push(*line);
+    liveRecords -= conversation.linesOnDisk;
+    conversation.linesOnDisk = 0;
+    if (!newestFirst.empty()) generations++;
+}
+
+// An empty conversation needs nothing written. If the file can't be made or written the conversation stays in
+// memory, and whatever records did get written are left for compaction.
+bool DMStore::spill(const std::string& peer, Conversation& conversation) {
+    const MessageHistory& lines = *conversation.lines;
+    uint64_t newest = 0;
+    size_t written = 0;
+    if (lines.size() > 0 && openSpillFile()) {
+        while (written < lines.size() && writeRecord(newest, lines[written], newest)) written++;
+    }
+    if (written < lines.size()) {
+        std::cerr << "Could not spill the conversation with " << peer << ", keeping it in memory" << std::endl;
+        return false;
+    }
+    conversation.linesOnDisk = lines.size();
+    conversation.newest = newest;
+    liveRecords += conversation.linesOnDisk;
+    conversation.lines.reset();
+    lru.erase(conversation.lru);
+    compactIfSparse();
+    return true;
+}
+
+bool DMStore::append(Conversation& conversation, std::string_view line) {
+    if (!writeRecord(conversation.newest, line, conversation.newest)) return false;
+    if (conversation.linesOnDisk < perConversation) { // Otherwise its oldest line just stopped counting
+        conversation.linesOnDisk++;
+        liveRecords++;
+    }
+    compactIfSparse();
+    return true;
+}
+
+// Appends a record at the end of the file. A failed write leaves the end where it was, to be written over.
+bool DMStore::writeRecord(uint64_t previous, std::string_view line, uint64_t& at) {
+    spillFile.clear();
+    spillFile.seekp((std::streamoff)spillEnd);
+    putRecord(spillFile, previous, line);
+    if (!spillFile) {
+        spillFile.clear();
+        return false;
+    }
+    at = spillEnd;
+    spillEnd += recordSize(line);
+    records++;
+    return true;
+}
+
+// Lines trimmed off the front of spilled conversations and conversations read back leave records nothing
+// points at. Once those outnumber the rest, the file is rewritten with just the live ones, so it stays within
+// about twice what the spilled conversations hold.
+void DMStore::compactIfSparse() {
+    if (records < std::max(2 * liveRecords + perConversation, compactFloor)) return;
+
+    std::string path = spillPathIn(spillDir);
+    std::string compacted = path + ".new";
+    std::ofstream out(compacted, std::ios::binary | std::ios::trunc);
+    std::vector<std::pair<Conversation*, uint64_t>> moved;
+    std::vector<std::string> newestFirst;
+    uint64_t end = 0;
+    bool ok = (bool)out;
+    for (auto& [peer, conversation] : conversations) {
+        if (!ok) break;
+        if (conversation.lines || conversation.linesOnDisk == 0) continue;
+        newestFirst.clear();
+        ok = readChain(spillFile, conversation.newest, conversation.linesOnDisk, newestFirst);
+        uint64_t previous = 0;
+        for (auto line = newestFirst.rbegin(); ok && line != newestFirst.rend(); ++line) {
+            putRecord(out, previous, *line);
+            previous = end;
+            end += recordSize(*line);
+        }
+        moved.emplace_back(&conversation, previous);
+    }
+    out.close();
+    spillFile.clear();
+    std::error_code error;
+    if (ok && out) {
+        spillFile.close(); // Windows won't replace it while it's open
+        std::filesystem::rename(compacted, path, error);
+    }
+    if (!ok || !out || error) {
+        std::cerr << "Could not compact the DM spill file in " << spillDir << std::endl;
+        std::filesystem::remove(compacted, error);
+        if (!spillFile.is_open()) spillFile.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        compactFloor = records + perConversation; // Not again on every line
+        return;
+    }
+
+    spillFile.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!spillFile.is_open()) std::cerr << "Could not reopen the DM spill file in " << spillDir << std::endl;
+    for (auto& [conversation, newest] : moved) conversation->newest = newest;
+    spillEnd = end;
+    records = liveRecords;
+    compactFloor = 0;
+}
+
+// The spill file goes in a new directory of our own, made the first time anything is spilled.
+bool DMStore::openSpillFile() {
+    if (spillFile.is_open()) return true;
+    if (spillDir.empty()) {
+        // It must be a new directory: one that already exists (maybe a link someone planted under the name) is
+        // never used, another random name is tried instead. Only the owner gets in.
+        std::random_device random;
+        std::error_code error;
+        std::filesystem::path temp = std::filesystem::temp_directory_path(error);
+        if (error) return false;
+        for (int attempt = 0; attempt < 16 && spillDir.empty(); attempt++) {
+            uint64_t id = ((uint64_t)random() << 32) | random();
+            std::filesystem::path dir = temp / ("genetworks-dms-" + std::to_string(id));
+            if (!std::filesystem::create_directory(dir, error)) continue; // Already there, or couldn't be made
+            std::filesystem::permissions(dir, std::filesystem::perms::owner_all, error);
+            if (error) {
+                std::filesystem::remove(dir, error);
+                continue;
+            }
+            spillDir = dir.string();
+        }
+        if (spillDir.empty()) return false;
+    }
+    bool fresh = records == 0; // Otherwise it was lost after a compaction and still holds spilled lines
+    std::ios::openmode mode = std::ios::in | std::ios::out | std::ios::binary;
+    spillFile.open(spillPathIn(spillDir), fresh ? mode | std::ios::trunc : mode);
+    return spillFile.is_open();
+}
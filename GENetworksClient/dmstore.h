@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "history.h"
+
+// Private conversations, bounded however many people someone talks to.
+// Each conversation keeps its last perConversation lines. Only the resident most recently used ones stay in
+// memory; past that the least recently used is written to the spill file and dropped. All conversations share
+// that one file, kept open in a private temp directory: each line goes in as a record pointing back at the
+// previous record of its conversation, so a spilled conversation is just the offset of its newest line.
+// Lines for a spilled conversation are appended without reading anything back, and a conversation is only
+// loaded again when it's opened. If the file can't be used the conversation stays in memory instead.
+class DMStore {
+public:
+    explicit DMStore(size_t perConversation = 1000, size_t resident = 32);
+    ~DMStore(); // Deletes the spill file
+
+    void add(const std::string& peer, std::string_view line);
+
+    // The conversation with peer, read back from disk first if it was spilled. Counts as using it.
+    const MessageHistory& open(const std::string& peer);
+
+    size_t residentCount() const { return lru.size(); }
+
+    // Bumped whenever a conversation's lines are read back. They're numbered afresh then,
+    // so anything keyed by line number (like the GUI's wrap cache) has to start over.
+    uint64_t generation() const { return generations; }
+
+private:
+    struct Conversation {
+        std::unique_ptr<MessageHistory> lines; // Null while spilled
+        std::list<std::string>::iterator lru;
+        uint64_t linesOnDisk = 0; // Its lines in the spill file that still count, at most perConversation
+        uint64_t newest = 0; // Offset of the newest of them
+    };
+
+    void touch(const std::string& peer, Conversation& conversation);
+    void load(const std::string& peer, Conversation& conversation);
+    bool spill(const std::string& peer, Conversation& conversation);
+    bool append(Conversation& conversation, std::string_view line);
+    bool writeRecord(uint64_t previous, std::string_view line, uint64_t& at);
+    void compactIfSparse();
+    bool openSpillFile();
+
+    size_t perConversation;
+    size_t resident;
+    std::unordered_map<std::string, Conversation> conversations;
+    std::list<std::string> lru; // Resident conversations, most recently used first
+    uint64_t generations = 0;
+
+    std::string spillDir; // Made on the first spill
+    std::fstream spillFile;
+    uint64_t spillEnd = 0; // Where the next record goes
+    uint64_t records = 0; // In the file, counting ones nothing points at any more
+    uint64_t liveRecords = 0; // linesOnDisk over every conversation
+    uint64_t compactFloor = 0; // After a failed compaction, records to reach before trying again
+};
@@ -0,0 +1,72 @@
+#include "events.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+std::string_view trimmed(std::string_view s) {
+    while (!s.empty() && std::isspace((unsigned char)s.front())) s.remove_prefix(1);
+    while (!s.empty() && std::isspace((unsigned char)s.back())) s.remove_suffix(1);
+    return s;
+}
+
+bool startsWith(std::string_view s, std::string_view prefix) {
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+void decodeRoster(ChatEvent& ev, std::string_view list) {
+    while (true) {
+        size_t comma = list.find(',');
+        std::string_view name = trimmed(list.substr(0, comma));
+        if (!name.empty()) ev.users.push_back(name);
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    std::sort(ev.users.begin(), ev.users.end());
+}
+
+}
+
+bool decodeEvent(ChatEvent& ev) {
+    std::string_view line = ev.text;
+    ev.name = std::string_view();
+    ev.users.clear();
+
+    if (startsWith(line, "USERS ")) { // This is used to build the clients list on the left side.
+        ev.type = EventType::Roster;
+        decodeRoster(ev, line.substr(6));
+        return true;
+    }
+
+    if (startsWith(line, "RECONNECT ")) return false; // receiveMessage keeps the delay for the connection thread
+
+    if (startsWith(line, "(DM) ")) { // DM logic, find sender
+        size_t colon = line.find(':', 5);
+        if (colon != std::string_view::npos) {
+            ev.type = EventType::DM;
+            ev.name = trimmed(line.substr(5, colon - 5));
+            return true;
+        }
+        return false;
+    }
+
+    if (startsWith(line, "(DM to ")) { // DM logic, find receiver
+        size_t close = line.find(')');
+        if (close != std::string_view::npos) {
+            ev.type = EventType::DMEcho;
+            ev.name = trimmed(line.substr(7, close - 7));
+            return true;
+        }
+        return false;
+    }
+
+    size_t colon = line.find(": ");
+    if (colon != std::string_view::npos) {
+        ev.type = EventType::RoomMessage;
+        ev.name = trimmed(line.substr(0, colon));
+    } else {
+        ev.type = EventType::System;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What a line from the server means, worked out on the receive thread so the UI only has to apply it.
+enum class EventType {
+    RoomMessage, // "name: text" in the room
+    DM,          // "(DM) name: text", name sent it to us
+    DMEcho,      // "(DM to name) text", our own DM coming back
+    Roster,      // "USERS a,b,c", everyone online
+    System       // Anything else the server says in the room (welcomes, joins, errors)
+};
+
+// One decoded line. Events live in the slots of the receive ring and are reused in place, so text keeps its
+// capacity and the views into it cost nothing. Copy the views out before the slot is released.
+struct ChatEvent {
+    EventType type = EventType::System;
+    std::string text;                    // The line itself, what the views point into
+    std::string_view name;               // Sender for RoomMessage and DM, recipient for DMEcho, trimmed
+    std::vector<std::string_view> users; // Roster only, trimmed, sorted and without empty names
+};
+
+// Works out what ev.text is and points ev's views into it. False if it's nothing the UI shows: the server's
+// RECONNECT hint, or a DM line that doesn't parse.
+bool decodeEvent(ChatEvent& ev);
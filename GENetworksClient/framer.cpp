@@ -0,0 +1,44 @@
+#include "framer.h"
+
+// The window is rounded up to a power of two so positions can be masked instead of wrapped.
+LineFramer::LineFramer(size_t window) {
+    size_t size = 1;
+    while (size < window) size <<= 1;
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+char* LineFramer::writePtr() {
+    if (tail - head == buffer.size()) grow();
+    return &buffer[tail & mask];
+}
+
+// Free space up to the end of the buffer or the start of unread data, whichever comes first.
+size_t LineFramer::writable() {
+    if (tail - head == buffer.size()) grow();
+    size_t at = tail & mask;
+    return std::min(buffer.size() - (tail - head), buffer.size() - at);
+}
+
+void LineFramer::commit(size_t n) {
+    tail += n;
+}
+
+std::string LineFramer::partial() const {
+    std::string out;
+    for (size_t i = head; i != tail; i++) out.push_back(buffer[i & mask]);
+    return out;
+}
+
+// Only happens when one line is bigger than the whole buffer. The unread bytes go to the front of one twice
+// the size, which keeps positions consistent with the new mask.
+void LineFramer::grow() {
+    std::vector<char> bigger(buffer.size() * 2);
+    size_t used = tail - head;
+    for (size_t i = 0; i < used; i++) bigger[i] = buffer[(head + i) & mask];
+    scan -= head;
+    head = 0;
+    tail = used;
+    buffer.swap(bigger);
+    mask = buffer.size() - 1;
+}
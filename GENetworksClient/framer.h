@@ -0,0 +1,62 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Splits a byte stream into '\n' terminated lines without moving the bytes around.
+// recv writes straight into a ring buffer, and extract walks only the bytes that arrived since the last call,
+// so each byte is looked at once however many lines a recv brings or however long a line takes to arrive.
+// A line that runs over the end of the buffer comes out in two pieces. The buffer doubles if a single line
+// ever fills it.
+class LineFramer {
+public:
+    explicit LineFramer(size_t window = 1 << 16);
+
+    // Where the next recv should write to and how many bytes fit there. Always at least one.
+    char* writePtr();
+    size_t writable();
+
+    // Marks n bytes written at writePtr as received.
+    void commit(size_t n);
+
+    // Calls onLine(first, second) for every complete line received, without its '\n'. second is empty unless
+    // the line wraps round the end of the buffer. Returns how many lines there were.
+    template <typename OnLine>
+    size_t extract(OnLine&& onLine) {
+        size_t lines = 0;
+        while (scan != tail) {
+            size_t at = scan & mask;
+            size_t len = std::min(tail - scan, buffer.size() - at); // Up to the end of the data or the buffer
+            const char* found = (const char*)std::memchr(&buffer[at], '\n', len);
+            if (!found) {
+                scan += len;
+                continue;
+            }
+            size_t end = scan + (found - &buffer[at]);
+            size_t start = head & mask;
+            if (start <= (end & mask)) {
+                onLine(std::string_view(&buffer[start], end - head), std::string_view());
+            } else {
+                onLine(std::string_view(&buffer[start], buffer.size() - start), std::string_view(buffer.data(), end & mask));
+            }
+            head = scan = end + 1;
+            lines++;
+        }
+        return lines;
+    }
+
+    // Bytes received after the last complete line.
+    std::string partial() const;
+
+private:
+    void grow();
+
+    std::vector<char> buffer;
+    size_t mask;
+    // Positions count up forever and are masked on use. head <= scan <= tail
+    size_t head = 0; // First byte of the line being received
+    size_t scan = 0; // Everything before this has been searched for '\n'
+    size_t tail = 0; // End of the received bytes
+};
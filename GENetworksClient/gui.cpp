@@ -1,8 +1,10 @@
 #include "gui.h"
 #include "imgui.h"
+#include "imgui_internal.h"
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 
 // Remove empty space
 void trim(std::string& s)
@@ -12,112 +14,106 @@ void trim(std::string& s)
     s.erase(std::find_if(s.rbegin(), s.rend(), notSpace).base(), s.end());
 }
 
-// Pops the sound event from the sound events queue after its played.
-bool GUI::popSoundEvent(SoundEvent& out)
+// Draws lines [first, first + count) of a pane (line(n) gives line n's text) inside the current child window.
+// ImGuiListClipper wants every row the same height and wrapped lines aren't, so this clips the same way but
+// against the cached tops: a binary search finds the visible lines, only those are laid out, and the space above
+// and below is skipped with the cursor so the scrollbar still covers the whole history.
+void drawWrappedLines(WrapCache& cache, uint64_t first, size_t count, const std::function<std::string_view(uint64_t)>& line)
 {
-    std::lock_guard<std::mutex> lock(mx);
-    if (sounds.empty()) return false;
-    out = sounds.front();
-    sounds.pop();
-    return true;
+    float width = ImGui::GetContentRegionAvail().x;
+    float fontSize = ImGui::GetFontSize();
+    float spacing = ImGui::GetStyle().ItemSpacing.y;
+
+    if (width != cache.width || fontSize != cache.fontSize || first < cache.start || first > cache.start + cache.tops.size() - 1)
+    {
+        cache.width = width;
+        cache.fontSize = fontSize;
+        cache.start = first;
+        cache.tops.assign(1, 0.0f);
+    }
+    if (first - cache.start > cache.tops.size() / 2) // Lines that have dropped out, trimmed in bulk
+    {
+        cache.tops.erase(cache.tops.begin(), cache.tops.begin() + (size_t)(first - cache.start));
+        cache.start = first;
+    }
+    for (uint64_t n = cache.start + cache.tops.size() - 1; n < first + count; n++) // Lines added since last frame
+    {
+        std::string_view text = line(n);
+        float height = ImGui::CalcTextSize(text.data(), text.data() + text.size(), false, width).y;
+        cache.tops.push_back(cache.tops.back() + height + spacing);
+    }
+    if (count == 0)
+        return;
+
+    const float* tops = cache.tops.data() + (size_t)(first - cache.start);
+    float origin = tops[0];
+    float total = tops[count] - origin;
+    float startY = ImGui::GetCursorPosY();
+    float visibleTop = ImGui::GetScrollY() - startY;
+    float visibleBottom = visibleTop + ImGui::GetWindowHeight();
+
+    size_t begin = std::upper_bound(tops, tops + count, visibleTop + origin) - tops;
+    begin = std::min(begin > 0 ? begin - 1 : 0, count - 1);
+    size_t end = std::lower_bound(tops + begin + 1, tops + count, visibleBottom + origin) - tops;
+
+    ImGui::SetCursorPosY(startY + tops[begin] - origin);
+    for (size_t i = begin; i < end; i++)
+    {
+        std::string_view text = line(first + i);
+        ImGui::TextWrapped("%.*s", (int)text.size(), text.data());
+    }
+    if (end < count)
+    {
+        ImGui::SetCursorPosY(startY + tops[end] - origin);
+        ImGui::Dummy(ImVec2(0.0f, total - (tops[end] - origin) - spacing)); // Extends the scroll range to the last line
+    }
 }
 
-// Used to get incoming information and process it onto the GUI.
-// Checks information in messages to see if they're updating the users, DMing, or simply broadcasting.
-void GUI::getMessages(const std::string& self)
+// One line saying whether we're connected, and if not, what the connection thread is up to
+void drawConnectionStatus(const GUI& ui)
 {
-    std::queue<std::string> local;
+    switch (ui.connection.load())
+    {
+    case ConnectionState::Connected:
+        ImGui::TextDisabled("Connected");
+        break;
+    case ConnectionState::Connecting:
+        ImGui::TextColored(ImVec4(1.0f, 0.8f, 0.3f, 1.0f), "Connecting...");
+        break;
+    case ConnectionState::Waiting:
     {
-        std::lock_guard<std::mutex> lock(mx);
-        std::swap(local, incomingMessages);
+        long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        long long left = std::max(0LL, ui.retryAtMs.load() - now);
+        ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "Disconnected, retrying in %.1fs. Messages are kept until then.", left / 1000.0);
+        break;
     }
+    case ConnectionState::Disconnected:
+        ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "Disconnected");
+        break;
+    }
+}
 
-    while (!local.empty())
+// Redraws nothing else would cause: the caret's next blink while a text box is active, and the reconnect countdown.
+void scheduleTimedFrames(GUI& ui)
+{
+    ImGuiContext& g = *ImGui::GetCurrentContext();
+    const ImGuiInputTextState& input = g.InputTextState;
+    if (g.IO.ConfigInputTextCursorBlink && input.ID != 0 && input.ID == g.ActiveId)
     {
-        std::string line = std::move(local.front());
-        local.pop();
-
-        if (line.rfind("USERS ", 0) == 0) // This is used to build the clients list on the left side.
+        // Same rule as InputText: shown while CursorAnim <= 0, then 0.8s on and 0.4s off
+        float untilToggle;
+        if (input.CursorAnim < 0.0f)
+            untilToggle = 0.80f - input.CursorAnim;
+        else
         {
-            users.clear();
-            std::string list = line.substr(6);
-
-            size_t start = 0;
-            while (start < list.size())
-            {
-                size_t comma = list.find(',', start);
-                std::string name = (comma == std::string::npos)
-                    ? list.substr(start)
-                    : list.substr(start, comma - start);
-                trim(name);
-                if (!name.empty())
-                    users.push_back(name);
-
-                if (comma == std::string::npos) break;
-                start = comma + 1;
-            }
-
-            std::sort(users.begin(), users.end());
-            if (selectedUser >= (int)users.size())
-                selectedUser = -1;
-
-            continue;
+            float phase = ImFmod(input.CursorAnim, 1.20f);
+            untilToggle = phase <= 0.80f ? 0.80f - phase : 1.20f - phase;
         }
-
-        if (line.rfind("(DM) ", 0) == 0)
-        {
-            size_t nameStartIndex = 5;
-            size_t colon = line.find(':', nameStartIndex);
-            if (colon != std::string::npos)
-            {
-                std::string from = line.substr(nameStartIndex, colon - nameStartIndex);
-                trim(from);
-                DMs[from].push_back(line);
-                if (from != self) {
-                    std::lock_guard<std::mutex> lock(mx);
-                    sounds.push(SoundEvent::DM);
-                }
-            }
-            continue; // DM logic, find sender
-        }
-
-        if (line.rfind("(DM to ", 0) == 0)
-        {
-            size_t close = line.find(')');
-            if (close != std::string::npos)
-            {
-                std::string to = line.substr(7, close - 7);
-                trim(to);
-                DMs[to].push_back(line);
-
-            }
-            continue; // DM logic, find receiver.
-        }
-        size_t colon = line.find(": ");
-        if (colon != std::string::npos)
-        {
-            std::string from = line.substr(0, colon);
-            trim(from);
-
-            if (!from.empty() && from != self)
-            {
-                std::lock_guard<std::mutex> lock(mx);
-                sounds.push(SoundEvent::Broadcast);
-            }
-        }
-
-        roomMessages.push_back(line); // Broadcast messages
-
-        if (roomMessages.size() > 5000)
-            roomMessages.erase(roomMessages.begin());
+        ui.frames.requestFrameIn(std::chrono::milliseconds((int)(untilToggle * 1000.0f) + 1));
     }
-}
 
-// Push a message into the queue
-void GUI::pushToQueue(std::string line)
-{
-    std::lock_guard<std::mutex> lock(mx);
-    incomingMessages.push(std::move(line));
+    if (ui.connection.load() == ConnectionState::Waiting)
+        ui.frames.requestFrameIn(std::chrono::milliseconds(100)); // Shown to a tenth of a second
 }
 
 // This draws the whole GUI. Takes the GUI class, the name of the user, and sendBroadcast and sendUnicast functions as args.
@@ -125,8 +121,11 @@ void GUI::pushToQueue(std::string line)
 void DrawChatUI(GUI& ui, const std::string& username, const std::function<void(const std::string&)>& sendBroadcast, const std::function<void(const std::string&, const std::string&)>& sendUnicast)
 {
     ui.getMessages(username); // Update GUI state from any newly received network messages
+    if (ui.selectedUser >= (int)ui.users.size())
+        ui.selectedUser = -1;
     ImGui::SetNextWindowSize(ImVec2(1100, 650), ImGuiCond_FirstUseEver);
     ImGui::Begin("Chat Client");
+    drawConnectionStatus(ui);
 
     float footerHeight = ImGui::GetFrameHeightWithSpacing();
     ImGui::BeginChild("Users", ImVec2(220, -footerHeight), true);
@@ -159,8 +158,8 @@ void DrawChatUI(GUI& ui, const std::string& username, const std::function<void(c
     float scrollMaxY = ImGui::GetScrollMaxY();
     bool wasAtBottom = (scrollY >= scrollMaxY - 5.0f); // Keep scroll pinned to bottom unless the user has manually scrolled up
 
-    for (const auto& msg : ui.roomMessages)
-        ImGui::TextWrapped("%s", msg.c_str());
+    uint64_t firstLine = ui.roomMessages.firstLine();
+    drawWrappedLines(ui.roomWrap, firstLine, ui.roomMessages.size(), [&](uint64_t n) { return ui.roomMessages[(size_t)(n - firstLine)]; });
 
     if (wasAtBottom)
         ImGui::SetScrollHereY(1.0f);
@@ -193,9 +192,17 @@ void DrawChatUI(GUI& ui, const std::string& username, const std::function<void(c
 
         ImGui::Begin(title.c_str(), &ui.dmOpen);
 
-        auto& log = ui.DMs[user];
-        for (auto& msg : log)
-            ImGui::TextWrapped("%s", msg.c_str());
+        const MessageHistory& log = ui.DMs.open(user); // Read back from disk if it's been a while
+        if (ui.dmWrapUser != user || ui.dmWrapGeneration != ui.DMs.generation()) // Line numbers start over on a reload
+        {
+            ui.dmWrap = WrapCache();
+            ui.dmWrapUser = user;
+            ui.dmWrapGeneration = ui.DMs.generation();
+        }
+        ImGui::BeginChild("Messages", ImVec2(0, -ImGui::GetFrameHeightWithSpacing() - ImGui::GetStyle().ItemSpacing.y));
+        uint64_t firstLine = log.firstLine();
+        drawWrappedLines(ui.dmWrap, firstLine, log.size(), [&](uint64_t n) { return log[(size_t)(n - firstLine)]; });
+        ImGui::EndChild();
 
         ImGui::Separator();
 
@@ -218,4 +225,6 @@ void DrawChatUI(GUI& ui, const std::string& username, const std::function<void(c
 
         ImGui::End();
     }
+
+    scheduleTimedFrames(ui);
 }
@@ -1,36 +1,35 @@
 #pragma once
 #include <string>
 #include <vector>
-#include <unordered_map>
-#include <queue>
-#include <mutex>
 #include <functional>
 
-enum class SoundEvent { Broadcast, DM }; // Play a different sound based on if its a DM or a Broadcast
+#include "chatstate.h"
 
-class GUI {
-public:
-    std::vector<std::string> users;
-    std::queue<SoundEvent> sounds;
-    std::vector<std::string> roomMessages;
-    std::unordered_map<std::string, std::vector<std::string>> DMs;
+// Where each line of a pane starts once wrapped, so a frame only lays out the lines it can see.
+// Only thrown away when the wrap width or the font size changes, or the lines are renumbered.
+struct WrapCache
+{
+    float width = -1.0f;
+    float fontSize = -1.0f;
+    uint64_t start = 0; // Line number of tops[0]
+    std::vector<float> tops; // Top of each line from start on, plus the bottom of the last one
+};
 
+// The chat state plus what the window itself needs to remember between frames.
+class GUI : public ChatState {
+public:
     char roomInput[1024] = "";
     char dmInput[1024] = "";
 
+    WrapCache roomWrap;
+    WrapCache dmWrap;
+    std::string dmWrapUser; // Whose conversation dmWrap is for
+    uint64_t dmWrapGeneration = 0; // DMs.generation() when dmWrap was started
+
     bool dmOpen = false;
     bool roomAutoScroll = true;
 
     int selectedUser = -1;
-
-    std::mutex mx;
-    std::queue<std::string> incomingMessages;
-
-    void pushToQueue(std::string line);
-
-    bool popSoundEvent(SoundEvent& out);
-
-    void getMessages(const std::string& self);
 };
 
 void DrawChatUI(
@@ -0,0 +1,61 @@
+// The client without a window, for bots and soak tests. Runs the same connection, receive path and chat state
+// as the GUI, prints the room and DMs as they arrive and sends each line typed on stdin.
+// Closing stdin quits, once anything already typed has had a moment to go out.
+#include "chatstate.h"
+#include "client.h"
+#include "connection.h"
+
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " <username> [host] [port]" << std::endl;
+        return 1;
+    }
+    const char* host = argc > 2 ? argv[2] : "127.0.0.1";
+    unsigned int port = argc > 3 ? (unsigned int)std::atoi(argv[3]) : 65432;
+    std::string username = argv[1];
+
+    if (!startNetworking()) {
+        std::cerr << "Networking failed to start" << std::endl;
+        return 1;
+    }
+
+    ChatState chat;
+    Outbox outbox;
+    Connection connection(chat, outbox, host, port, username);
+    connection.start();
+
+    std::atomic<bool> inputClosed(false);
+    std::thread input([&] {
+        std::string line;
+        while (std::getline(std::cin, line)) outbox.post(line);
+        inputClosed.store(true);
+        chat.frames.markDirty();
+    });
+
+    chat.onEvent = [](const ChatEvent& ev) {
+        if (ev.type != EventType::Roster) std::cout << ev.text << '\n';
+    };
+
+    ConnectionState shown = ConnectionState::Connecting;
+    while (!inputClosed.load()) {
+        chat.frames.waitUntilDue();
+        chat.frames.beginFrame();
+        chat.getMessages(username);
+        SoundEvent ignored; // Nothing to play them on
+        while (chat.popSoundEvent(ignored)) {}
+
+        ConnectionState state = chat.connection.load();
+        if (state != shown && (state == ConnectionState::Connected || shown == ConnectionState::Connected))
+            std::cerr << (state == ConnectionState::Connected ? "Connected" : "Disconnected") << std::endl;
+        shown = state;
+        std::cout.flush();
+    }
+
+    if (chat.connection.load() == ConnectionState::Connected) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    connection.stop();
+    input.join();
+    stopNetworking();
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include "history.h"
+
+#include <algorithm>
+#include <cstring>
+
+MessageHistory::MessageHistory(size_t capacity, size_t chunkSize)
+    : capacity(std::max<size_t>(capacity, 1)), chunkSize(chunkSize), records(this->capacity) {}
+
+void MessageHistory::push(std::string_view text) {
+    if (next - first == capacity) first++;
+
+    // Hand back every chunk whose lines have all gone. The one being written to stays.
+    while (chunks.size() > 1 && chunks.front().lastRecord < first) {
+        if (spare.size() < 2) spare.push_back(std::move(chunks.front()));
+        chunks.pop_front();
+        firstChunk++;
+    }
+
+    if (chunks.empty() || chunks.back().size - chunks.back().used < text.size()) startChunk(text.size());
+
+    Chunk& chunk = chunks.back();
+    std::memcpy(chunk.data.get() + chunk.used, text.data(), text.size());
+    records[next % capacity] = { firstChunk + chunks.size() - 1, (uint32_t)chunk.used, (uint32_t)text.size() };
+    chunk.used += text.size();
+    chunk.lastRecord = next;
+    next++;
+}
+
+std::string_view MessageHistory::operator[](size_t i) const {
+    const Record& record = records[(first + i) % capacity];
+    return std::string_view(chunks[(size_t)(record.chunk - firstChunk)].data.get() + record.offset, record.length);
+}
+
+// A line longer than a whole chunk gets a chunk of its own size.
+void MessageHistory::startChunk(size_t atLeast) {
+    Chunk chunk;
+    if (!spare.empty() && spare.back().size >= atLeast) {
+        chunk = std::move(spare.back());
+        spare.pop_back();
+    } else {
+        chunk.size = std::max(chunkSize, atLeast);
+        chunk.data.reset(new char[chunk.size]);
+    }
+    chunk.used = 0;
+    chunks.push_back(std::move(chunk));
+}
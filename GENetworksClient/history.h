@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// The last capacity lines of a chat, oldest first. Adding a line past capacity drops the oldest one without
+// moving anything else.
+// Records sit in a fixed ring and the text they point at is appended to large chunks. A chunk is only ever
+// written at its end and is reused whole once every line in it has dropped out, so a line costs its bytes plus
+// a small record, not a string with its own allocation.
+class MessageHistory {
+public:
+    explicit MessageHistory(size_t capacity = 5000, size_t chunkSize = 1 << 16);
+
+    void push(std::string_view text);
+
+    size_t size() const { return (size_t)(next - first); }
+    uint64_t firstLine() const { return first; } // Number of the line at [0], counting every line ever pushed
+    std::string_view operator[](size_t i) const; // 0 is the oldest
+
+private:
+    struct Record {
+        uint64_t chunk;  // Sequence number of the chunk holding the text
+        uint32_t offset;
+        uint32_t length;
+    };
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size = 0;
+        size_t used = 0;
+        uint64_t lastRecord = 0; // Newest line in it, it's free once that one has dropped out
+    };
+
+    void startChunk(size_t atLeast);
+
+    size_t capacity;
+    size_t chunkSize;
+    std::vector<Record> records; // Ring, line n is at n % capacity
+    uint64_t first = 0; // Line numbers count up forever, first is the oldest kept and next the one after the newest
+    uint64_t next = 0;
+    std::deque<Chunk> chunks; // Oldest first, only the last one is written to
+    uint64_t firstChunk = 0; // Sequence number of chunks.front()
+    std::vector<Chunk> spare; // Freed chunks waiting to be reused
+};
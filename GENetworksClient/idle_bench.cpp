@@ -0,0 +1,125 @@
+// What an idle client costs. Runs the window's main loop with FrameScheduler deciding when to draw, but with no
+// window, no network and nothing drawn, for a few seconds per case:
+//   idle        nothing on screen changes
+//   caret       a text box has focus, so the caret blinks (0.8 s on, 0.4 s off, as in gui.cpp)
+//   countdown   the reconnect countdown is showing, redrawn every tenth of a second
+//   vsync       the loop before FrameScheduler, a frame every 16 ms whatever happens, for comparison
+// Usage: genetworks_idle_bench [seconds per case]. Numbers go to stdout as a table.
+#include "scheduler.h"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ctime>
+#endif
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// CPU time used by the whole process so far, every thread, user and kernel.
+double processCpuMs() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return ((unsigned long long)t.dwHighDateTime << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 10000.0; // 100 ns ticks
+#else
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+#endif
+}
+
+// Stands in for the window's message queue: the scheduler's wakeup posts to it, and the loop sleeps on it the way
+// main.cpp sleeps in MsgWaitForMultipleObjects.
+struct MessageWait {
+    std::mutex mx;
+    std::condition_variable posted;
+    bool pending = false;
+
+    void post() {
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            pending = true;
+        }
+        posted.notify_one();
+    }
+
+    void wait(long long ms) {
+        std::unique_lock<std::mutex> lock(mx);
+        if (ms < 0) posted.wait(lock, [&] { return pending; });
+        else posted.wait_for(lock, std::chrono::milliseconds(ms), [&] { return pending; });
+        pending = false;
+    }
+};
+
+enum class Case { Idle, Caret, Countdown, Vsync };
+
+// What the UI asks for as it draws a frame, from DrawChatUI's deadlines.
+void requestNext(FrameScheduler& frames, Case c, FrameScheduler::Clock::time_point start) {
+    if (c == Case::Caret) {
+        long long phase = std::chrono::duration_cast<std::chrono::milliseconds>(frames.now() - start).count() % 1200;
+        frames.requestFrameIn(std::chrono::milliseconds((phase < 800 ? 800 : 1200) - phase + 1));
+    } else if (c == Case::Countdown) {
+        frames.requestFrameIn(100ms);
+    } else if (c == Case::Vsync) {
+        frames.markDirty();
+    }
+}
+
+void run(const char* label, Case c, std::chrono::milliseconds span) {
+    FrameScheduler frames;
+    MessageWait messages;
+    frames.setWakeup([&] { messages.post(); });
+
+    auto start = FrameScheduler::Clock::now();
+    auto end = start + span;
+    double cpuStart = processCpuMs();
+    int drawn = 0;
+    while (FrameScheduler::Clock::now() < end) {
+        // Same policy as the window's loop: sleep until a frame is due, and don't draw if woken early
+        long long waitMs = frames.msUntilNextFrame();
+        long long leftMs = std::chrono::ceil<std::chrono::milliseconds>(end - FrameScheduler::Clock::now()).count();
+        if (waitMs < 0 || waitMs > leftMs) waitMs = leftMs; // The run ends before the frame would be due
+        if (waitMs != 0) messages.wait(waitMs);
+        if (frames.msUntilNextFrame() != 0) continue;
+
+        frames.beginFrame();
+        drawn++;
+        requestNext(frames, c, start);
+        if (c == Case::Vsync) std::this_thread::sleep_for(16ms); // Present blocking until the next vblank
+    }
+    double seconds = std::chrono::duration<double>(FrameScheduler::Clock::now() - start).count();
+    double cpuMs = processCpuMs() - cpuStart;
+
+    std::cout << std::setw(12) << label << std::fixed << std::setprecision(1) << std::setw(12) << drawn / seconds
+        << std::setw(14) << cpuMs << std::setw(14) << cpuMs / seconds << std::defaultfloat << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? std::atoi(argv[1]) : 5;
+    if (argc > 2 || seconds <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [seconds per case]" << std::endl;
+        return 1;
+    }
+    std::chrono::milliseconds span(seconds * 1000);
+
+    std::cout << seconds << " s per case, the scheduler and main loop only (nothing is drawn)" << std::endl;
+    std::cout << std::setw(12) << "case" << std::setw(12) << "frames/s" << std::setw(14) << "cpu ms" << std::setw(14) << "cpu ms/s" << std::endl;
+    run("idle", Case::Idle, span);
+    run("caret", Case::Caret, span);
+    run("countdown", Case::Countdown, span);
+    run("vsync", Case::Vsync, span);
+    return 0;
+}
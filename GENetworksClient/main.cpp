@@ -6,6 +6,7 @@
 // - Documentation        https://dearimgui.com/docs (same as your local docs/ folder).
 // - Introduction, links and more at the top of imgui.cpp
 #include "client.h"
+#include "connection.h"
 
 #include "imgui.h"
 #include "imgui_impl_win32.h"
@@ -32,21 +33,20 @@ void CreateRenderTarget();
 void CleanupRenderTarget();
 LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 
-static SOCKET sock = INVALID_SOCKET;
-static std::atomic<bool> run(false);
-static std::thread t;
+static Outbox outbox;
 
 
 int main(int argc, char* argv[]) {
-    WSADATA wsa{}; // Init Winsock
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    if (!startNetworking()) // Init Winsock
     {
         MessageBoxA(nullptr, "WSAStartup failed", "Error", MB_OK);
         return 1;
     }
-    if (argc != 2) {
-        std::cout << "Please enter a username as an arguement (.\\GENetworksClients.exe <username>)" << std::endl;
-    } // Get username from args
+    if (argc < 2 || argc > 4) {
+        std::cout << "Please enter a username as an arguement (.\\GENetworksClients.exe <username> [host] [port])" << std::endl;
+    } // Get username from args, and optionally where the server is
+    const char* host = argc > 2 ? argv[2] : "127.0.0.1";
+    unsigned int port = argc > 3 ? (unsigned int)std::atoi(argv[3]) : 65432;
 
     HRESULT hrCom = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
     const bool comOk = SUCCEEDED(hrCom) || hrCom == S_FALSE;
@@ -120,21 +120,23 @@ int main(int argc, char* argv[]) {
     bool b_button = false;
     float r = 10.f;
     GUI chat; // Make a GUI instance and connect to server
-    if (!connectToServer(sock, "127.0.0.1", 65432)) // Connect to server
-    {
-        MessageBoxA(nullptr, "Failed to connect to server", "Error", MB_OK);
-        return 1;
-    }
-
-    // Send username
-    sendLine(sock, argv[1]);
-
-    // Start receive thread
-    startReceive(sock, run, chat, t);
+    // Connects, logs in and reconnects in the background, the window shows how it's going
+    Connection connection(chat, outbox, host, port, argv[1]);
+    chat.frames.setWakeup([hwnd] { ::PostMessage(hwnd, WM_NULL, 0, 0); }); // Network threads wake the message wait below
+    connection.start();
     // Main loop
     bool done = false;
     while (!done)
     {
+        // Sleep until a frame is needed: window input, something from the network, or a deadline like the caret blink
+        long long waitMs = chat.frames.msUntilNextFrame();
+        if (waitMs != 0)
+            ::MsgWaitForMultipleObjects(0, nullptr, FALSE, waitMs < 0 ? INFINITE : (DWORD)waitMs, QS_ALLINPUT);
+
+        // Take what the receive thread published on every wakeup, drawn or not. While minimized nothing is drawn,
+        // and if the ring filled up the receive thread would stall until the server gave up on us.
+        chat.getMessages(argv[1]);
+
         SoundEvent ev; // Play sounds
         while (chat.popSoundEvent(ev)) {
             if (ev == SoundEvent::Broadcast) sm.play("broadcast.wav");
@@ -151,9 +153,12 @@ int main(int argc, char* argv[]) {
             ::DispatchMessage(&msg);
             if (msg.message == WM_QUIT)
                 done = true;
+            chat.frames.markDirty();
         }
         if (done)
             break;
+        if (chat.frames.msUntilNextFrame() != 0)
+            continue; // Woken early, nothing to draw yet
 
         // Handle window being minimized or screen locked
         if (g_SwapChainOccluded && g_pSwapChain->Present(0, DXGI_PRESENT_TEST) == DXGI_STATUS_OCCLUDED)
@@ -173,16 +178,17 @@ int main(int argc, char* argv[]) {
         }
 
         // Start the Dear ImGui frame
+        chat.frames.beginFrame();
        
 
-        auto sendBroadcast = [&](const std::string& msg) // Simple broadcast+unicast
+        auto sendBroadcast = [&](const std::string& msg) // Simple broadcast+unicast, queued for the send thread
             {
-                sendLine(sock, msg); 
+                outbox.post(msg);
             };
 
         auto sendUnicast = [&](const std::string& to, const std::string& msg)
             {
-                sendLine(sock, "/msg " + to + " " + msg);
+                outbox.post("/msg " + to + " " + msg);
             };
 
         ImGui_ImplDX11_NewFrame();
@@ -203,11 +209,8 @@ int main(int argc, char* argv[]) {
         g_SwapChainOccluded = (hr == DXGI_STATUS_OCCLUDED);
     }
     //Shutdowns/free memory and cleanup
-    run.store(false);
-    shutdown(sock, SD_BOTH);
-    closesocket(sock);
-    if (t.joinable())
-        t.join();
+    chat.frames.setWakeup(nullptr);
+    connection.stop(); // The send thread gets to finish what's queued, unless closing the socket cuts it off first
 
     ImGui_ImplDX11_Shutdown();
     ImGui_ImplWin32_Shutdown();
@@ -216,7 +219,7 @@ int main(int argc, char* argv[]) {
     CleanupDeviceD3D();
     ::DestroyWindow(hwnd);
     ::UnregisterClassW(wc.lpszClassName, wc.hInstance);
-    WSACleanup();
+    stopNetworking();
     if (comOk) CoUninitialize();
     return 0;
 }
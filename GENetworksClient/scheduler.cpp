@@ -0,0 +1,65 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+void FrameScheduler::markDirty() {
+    std::function<void()> wake;
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        bool wasIdle = dirtyFrames == 0;
+        dirtyFrames = std::max(dirtyFrames, settleFrames);
+        if (wasIdle) wake = wakeup; // Already awake otherwise, no need to nudge the shell again
+    }
+    changed.notify_all();
+    if (wake) wake();
+}
+
+void FrameScheduler::requestFrameAt(Clock::time_point at) {
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        deadline = std::min(deadline, at);
+    }
+    changed.notify_all();
+}
+
+void FrameScheduler::requestFrameIn(std::chrono::milliseconds delay) {
+    requestFrameAt(now() + delay);
+}
+
+FrameScheduler::Clock::time_point FrameScheduler::nextFrameAt() {
+    std::lock_guard<std::mutex> lock(mx);
+    return dirtyFrames > 0 ? Clock::time_point::min() : deadline;
+}
+
+long long FrameScheduler::msUntilNextFrame() {
+    Clock::time_point next = nextFrameAt();
+    if (next == Clock::time_point::max()) return -1;
+    Clock::time_point current = now();
+    if (next <= current) return 0;
+    return std::chrono::ceil<std::chrono::milliseconds>(next - current).count();
+}
+
+bool FrameScheduler::waitUntilDue(Clock::time_point limit) {
+    std::unique_lock<std::mutex> lock(mx);
+    while (true) {
+        if (dirtyFrames > 0 || deadline <= now()) return true;
+        Clock::time_point until = std::min(deadline, limit);
+        if (until == Clock::time_point::max()) {
+            changed.wait(lock);
+        } else {
+            if (limit <= now()) return false;
+            changed.wait_until(lock, until);
+        }
+    }
+}
+
+void FrameScheduler::beginFrame() {
+    std::lock_guard<std::mutex> lock(mx);
+    if (dirtyFrames > 0) dirtyFrames--;
+    if (deadline <= now()) deadline = Clock::time_point::max();
+}
+
+void FrameScheduler::setWakeup(std::function<void()> wakeup) {
+    std::lock_guard<std::mutex> lock(mx);
+    this->wakeup = std::move(wakeup);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+// Decides when the client needs to draw a frame, so the window can sleep while nothing changes instead of
+// redrawing at vsync forever.
+// Two things make a frame due: something changing (a network event, window input), which any thread reports
+// with markDirty, and deadlines the UI sets for itself (the caret's next blink, a countdown). Between frames the
+// shell waits until nextFrameAt, on its own wait (which setWakeup lets markDirty interrupt) or on waitUntilDue.
+class FrameScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Any thread. A change draws a few frames, since ImGui settles some things (scrolling, sizes) the frame after.
+    void markDirty();
+
+    // UI thread. Draw again no later than at.
+    void requestFrameAt(Clock::time_point at);
+    void requestFrameIn(std::chrono::milliseconds delay);
+
+    // When the next frame is needed: in the past if one is due now, Clock::time_point::max() if nothing is pending.
+    Clock::time_point nextFrameAt();
+
+    // How long the shell can sleep before the next frame: 0 if one is due, -1 if nothing is pending. Rounded up to
+    // whole milliseconds, so a shell that sleeps in those doesn't wake just short of a deadline and spin.
+    long long msUntilNextFrame();
+
+    // Blocks until a frame is due or until limit, whichever is first. True if a frame is due.
+    bool waitUntilDue(Clock::time_point limit = Clock::time_point::max());
+
+    // Called as a frame starts. Uses up one dirty frame and any deadline that has passed.
+    void beginFrame();
+
+    // Called by markDirty after it's recorded, from whichever thread marked it, so a shell sleeping on something
+    // other than waitUntilDue (like a window message queue) can be woken.
+    void setWakeup(std::function<void()> wakeup);
+
+    int settleFrames = 3;
+
+    // The time deadlines are measured against. Tests replace it with a clock they move by hand; waits still
+    // sleep in real time, so with such a clock only ask waitUntilDue about a limit that has already passed.
+    std::function<Clock::time_point()> now = [] { return Clock::now(); };
+
+private:
+    std::mutex mx;
+    std::condition_variable changed;
+    int dirtyFrames = 1; // The first frame is always due
+    Clock::time_point deadline = Clock::time_point::max();
+    std::function<void()> wakeup;
+};
@@ -0,0 +1,96 @@
+// Checks FrameScheduler the way the window uses it: draw whenever a frame is due, sleep otherwise.
+// An idle window draws nothing, a change draws its settle frames and stops, and an animation gets its cadence.
+#include "scheduler.h"
+
+#include <iostream>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Frames drawn in the next span, as the shell's loop would draw them.
+int framesIn(FrameScheduler& frames, FrameScheduler::Clock::duration span) {
+    auto limit = FrameScheduler::Clock::now() + span;
+    int drawn = 0;
+    while (frames.waitUntilDue(limit)) {
+        frames.beginFrame();
+        drawn++;
+        if (drawn > 1000) break; // Spinning, no point counting further
+    }
+    return drawn;
+}
+
+}
+
+int main() {
+    {
+        FrameScheduler frames;
+        check(framesIn(frames, 50ms) == 1, "only the first frame is drawn");
+        check(frames.nextFrameAt() == FrameScheduler::Clock::time_point::max(), "nothing pending once idle");
+        check(framesIn(frames, 100ms) == 0, "an idle window draws no frames");
+    }
+    {
+        FrameScheduler frames;
+        frames.settleFrames = 1;
+        framesIn(frames, 10ms);
+        frames.markDirty();
+        check(frames.nextFrameAt() <= FrameScheduler::Clock::now(), "a change makes a frame due now");
+        check(framesIn(frames, 50ms) == 1, "a change draws one frame");
+        frames.settleFrames = 3;
+        frames.markDirty();
+        frames.markDirty(); // Changes before the frame share it
+        check(framesIn(frames, 50ms) == 3, "a change draws its settle frames");
+    }
+    {
+        FrameScheduler frames;
+        framesIn(frames, 10ms);
+        int woken = 0;
+        frames.setWakeup([&] { woken++; });
+        std::thread network([&] {
+            std::this_thread::sleep_for(30ms);
+            frames.markDirty();
+            frames.markDirty();
+        });
+        auto start = FrameScheduler::Clock::now();
+        check(frames.waitUntilDue(start + 2s), "another thread's change wakes the wait");
+        check(FrameScheduler::Clock::now() - start < 1s, "the wait ends when the change comes, not at its limit");
+        network.join();
+        check(woken == 1, "the shell is nudged once while the frame is pending");
+    }
+    {
+        // A caret blinking every 50 ms: the UI asks for its next frame each time it draws one. Time is moved by
+        // hand a millisecond at a time, so the count doesn't depend on how busy the machine running the test is.
+        FrameScheduler frames;
+        auto fake = FrameScheduler::Clock::now();
+        frames.now = [&] { return fake; };
+        frames.beginFrame();
+        frames.requestFrameIn(50ms);
+        check(frames.nextFrameAt() > fake, "a deadline isn't due early");
+        check(frames.msUntilNextFrame() == 50, "the shell sleeps until the deadline");
+        int drawn = 0;
+        for (int ms = 0; ms < 500; ms++) {
+            fake += 1ms;
+            while (frames.waitUntilDue(fake)) {
+                frames.beginFrame();
+                drawn++;
+                frames.requestFrameIn(50ms);
+            }
+        }
+        check(drawn == 10, "an animation gets one frame per interval");
+        check(frames.msUntilNextFrame() == 50, "and the next one is a whole interval away");
+    }
+
+    if (failures > 0) return 1;
+    std::cout << "scheduler_test passed" << std::endl;
+    return 0;
+}
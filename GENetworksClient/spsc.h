@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Bounded single-producer/single-consumer ring. One thread fills slots and publishes them, another reads and
+// releases them, with no lock: each side only writes its own index and reads the other's.
+// Slots are reused in place, so a slot type that keeps its capacity (like std::string) stops allocating once
+// the ring has gone round. Both sides work in batches: the producer fills any number of slots and publishes
+// them with one store, the consumer takes everything published so far and releases it with one store.
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    SpscRing() : slots(new T[Capacity]) {}
+
+    // Producer side. Slot i of the batch being filled (0 is the first unpublished one), or nullptr if the ring
+    // is full that far. Publish what's filled and try again once the consumer has caught up.
+    T* claim(size_t i) {
+        size_t at = tail.load(std::memory_order_relaxed) + i;
+        if (at - headSeen >= Capacity) {
+            headSeen = head.load(std::memory_order_acquire);
+            if (at - headSeen >= Capacity) return nullptr;
+        }
+        return &slots[at & (Capacity - 1)];
+    }
+
+    // Producer side. Makes the first count claimed slots visible to the consumer.
+    void publish(size_t count) {
+        if (count == 0) return;
+        tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    // Consumer side. Number of published slots not yet released.
+    size_t available() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side. Published slot i, 0 being the oldest.
+    T& at(size_t i) {
+        return slots[(head.load(std::memory_order_relaxed) + i) & (Capacity - 1)];
+    }
+
+    // Consumer side. Hands the oldest count slots back to the producer.
+    void release(size_t count) {
+        if (count == 0) return;
+        head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+private:
+    // Each index on its own cache line, so the two threads don't keep taking the line from each other.
+    alignas(64) std::atomic<size_t> tail{ 0 }; // Written by the producer
+    size_t headSeen = 0; // Producer's last look at head, only reloaded when the ring seems full
+    alignas(64) std::atomic<size_t> head{ 0 }; // Written by the consumer
+    std::unique_ptr<T[]> slots;
+};